@@ -2,4 +2,5 @@
 
 mkdir -p build
 
-clang -g -O0 -lm -lSDL2 src/main.c src/stb.c -o build/softy
+clang -g -O0 -lm -lpthread -lSDL2 src/main.c src/stb.c -o build/softy
+clang -g -O0 -lm -lpthread src/convert.c -o build/convert
@@ -0,0 +1,21 @@
+#include "primitives.h"
+
+// Converts an OBJ file to the binary mesh file mapped by `load_mesh`.
+int main(int argc, char **argv) {
+  if (argc != 3) {
+    printf("Usage: %s <input.obj> <output.mesh>\n", argv[0]);
+    return 1;
+  }
+
+  Memory memory;
+  ASSERT(init_memory(&memory, 0), "Failed to initialize memory");
+  ThreadPool pool;
+  thread_pool_init(&pool, cpu_count() - 1);
+  Model model;
+  bool loaded = load_model(&memory, &pool, argv[1], MODEL_LOAD_DEFAULT, &model);
+  if (loaded)
+    save_mesh(&model, argv[2]);
+  memory_report(&memory);
+  thread_pool_destroy(&pool);
+  return loaded ? 0 : 1;
+}
@@ -4,6 +4,8 @@
 #include "math.h"
 #include "memory.h"
 #include "primitives.h"
+#include "raster.h"
+#include "threads.h"
 #include <SDL2/SDL.h>
 
 #include "stb_image.h"
@@ -15,6 +17,14 @@
 
 #define WINDOW_WIDTH 1280
 #define WINDOW_HIGHT 720
+// Building with GAME_HUGE_PAGES backs the arenas and an own render target
+// by huge pages and faults them in at startup. Otherwise the arenas commit
+// lazily and frames are drawn straight to the window surface.
+#ifdef GAME_HUGE_PAGES
+#define GAME_MEMORY_FLAGS (MemoryHugePages | MemoryPrefault)
+#else
+#define GAME_MEMORY_FLAGS 0
+#endif
 
 typedef struct {
   stbtt_bakedchar *char_info;
@@ -56,14 +66,6 @@ Font load_font(Memory *memory, const char *font_path, f32 font_size,
 
   return font;
 }
-
-typedef struct {
-  u32 width;
-  u32 hight;
-  u32 channels;
-  u8 *data;
-} BitMap;
-
 BitMap load_bitmap(Memory *memory, const char *filename) {
   i32 x;
   i32 y;
@@ -291,402 +293,6 @@ void draw_aabb(BitMap *dst, Rect *rect_dst, AABB *aabb, u32 color) {
   }
 }
 
-bool triangle_ccw(Triangle *triangle) {
-  f32 area =
-      0.5 *
-      ((triangle->v2.x - triangle->v0.x) * (triangle->v1.y - triangle->v0.y) -
-       (triangle->v1.x - triangle->v0.x) * (triangle->v2.y - triangle->v0.y));
-  return 0.0 < area;
-}
-
-V3 calculate_interpolation(Triangle *triangle, V2 p) {
-#if 1
-  f32 total_area = 0.5 * v3_len(v3_cross(v3_sub(triangle->v2, triangle->v0),
-                                         v3_sub(triangle->v1, triangle->v0)));
-  f32 u =
-      (p.x * (triangle->v0.y - triangle->v2.y) +
-       p.y * (triangle->v2.x - triangle->v0.x) +
-       (triangle->v0.x * triangle->v2.y - triangle->v2.x * triangle->v0.y)) /
-      (2.0 * total_area);
-  f32 v =
-      (p.x * (triangle->v1.y - triangle->v0.y) +
-       p.y * (triangle->v0.x - triangle->v1.x) +
-       (triangle->v1.x * triangle->v0.y - triangle->v0.x * triangle->v1.y)) /
-      (2.0 * total_area);
-
-  f32 r = 1.0 - u - v;
-  return (V3){r, u, v};
-#else
-  f32 w0 =
-      ((triangle->v1.y - triangle->v2.y) * (p.x - triangle->v2.x) +
-       (triangle->v2.x - triangle->v1.x) * (p.y - triangle->v2.y)) /
-      ((triangle->v1.y - triangle->v2.y) * (triangle->v0.x - triangle->v2.x) +
-       (triangle->v2.x - triangle->v1.x) * (triangle->v0.y - triangle->v2.y));
-  f32 w1 =
-      ((triangle->v2.y - triangle->v0.y) * (p.x - triangle->v2.x) +
-       (triangle->v0.x - triangle->v2.x) * (p.y - triangle->v2.y)) /
-      ((triangle->v1.y - triangle->v2.y) * (triangle->v0.x - triangle->v2.x) +
-       (triangle->v2.x - triangle->v1.x) * (triangle->v0.y - triangle->v2.y));
-  f32 w2 = 1.0 - w0 - w1;
-  return (V3){w0, w1, w2};
-#endif
-}
-
-void draw_triangle_flat_bottom(f32 *depthbuffer, BitMap *dst, AABB *aabb_dst,
-                               u32 color, Triangle *triangle,
-                               Triangle *orig_triangle) {
-  AABB aabb_tri = triangle_aabb(triangle);
-  if (!aabb_intersect(&aabb_tri, aabb_dst))
-    return;
-
-  AABB intersection = aabb_intersection(&aabb_tri, aabb_dst);
-  u32 copy_area_hight = aabb_hight_u32(&intersection);
-
-  f32 inv_slope_1 =
-      (triangle->v1.x - triangle->v0.x) / (triangle->v1.y - triangle->v0.y);
-  f32 inv_slope_2 =
-      (triangle->v2.x - triangle->v0.x) / (triangle->v2.y - triangle->v0.y);
-
-  f32 x1 = triangle->v0.x;
-  f32 x2 = triangle->v0.x;
-  if (triangle->v0.y < intersection.min.y) {
-    x1 += inv_slope_1 * (intersection.min.y - triangle->v0.y);
-    x2 += inv_slope_2 * (intersection.min.y - triangle->v0.y);
-  }
-
-  u8 *dst_start =
-      dst->data + f32_to_u32_round_down(intersection.min.x) * dst->channels +
-      f32_to_u32_round_down(intersection.min.y) * dst->width * dst->channels;
-  depthbuffer += f32_to_u32_round_down(intersection.min.x) +
-                 f32_to_u32_round_down(intersection.min.y) * dst->width;
-  for (u32 y = 0; y < copy_area_hight; y++) {
-    u8 *dst_row = dst_start;
-    f32 *depth_row = depthbuffer;
-    f32 x1_bound = MIN(MAX(x1, intersection.min.x), intersection.max.x);
-    f32 x2_bound = MIN(MAX(x2, intersection.min.x), intersection.max.x);
-    f32 line_start = MIN(x1_bound, x2_bound);
-    f32 line_end = MAX(x1_bound, x2_bound);
-    dst_row +=
-        f32_to_u32_round_down(line_start - intersection.min.x) * dst->channels;
-    depth_row += f32_to_u32_round_down(line_start - intersection.min.x);
-    u32 line_width = f32_to_u32_round_down(line_end - line_start);
-    for (u32 x = 0; x < line_width; x++) {
-      V2 p = {line_start + (f32)x, intersection.min.y + (f32)y};
-      V3 w = calculate_interpolation(orig_triangle, p);
-      f32 depth = w.x * orig_triangle->v0.z + w.y * orig_triangle->v1.z +
-                  w.z * orig_triangle->v2.z;
-      f32 *current_depth = depth_row + x;
-      if (*current_depth < depth) {
-        *current_depth = depth;
-
-        V3 normal =
-            v3_add(v3_add(v3_mul(orig_triangle->v0_vertex->normal, w.x),
-                          v3_mul(orig_triangle->v1_vertex->normal, w.y)),
-                   v3_mul(orig_triangle->v2_vertex->normal, w.z));
-        u32 normal_color = (u32)(fabs(normal.x * 255.0)) << 16 |
-                           (u32)(fabs(normal.y * 255.0)) << 8 |
-                           (u32)(fabs(normal.z * 255.0)) << 0;
-
-        u32 *dst_color = (u32 *)(dst_row + x * dst->channels);
-        // *dst_color = color;
-        *dst_color = normal_color;
-      }
-    }
-    x1 += inv_slope_1;
-    x2 += inv_slope_2;
-    dst_start += dst->width * dst->channels;
-    depthbuffer += dst->width;
-  }
-}
-
-void draw_triangle_flat_top(f32 *depthbuffer, BitMap *dst, AABB *aabb_dst,
-                            u32 color, Triangle *triangle,
-                            Triangle *orig_triangle) {
-  AABB aabb_tri = triangle_aabb(triangle);
-  if (!aabb_intersect(&aabb_tri, aabb_dst))
-    return;
-
-  AABB intersection = aabb_intersection(&aabb_tri, aabb_dst);
-  u32 copy_area_hight = aabb_hight_u32(&intersection);
-
-  f32 inv_slope_1 =
-      (triangle->v2.x - triangle->v0.x) / (triangle->v2.y - triangle->v0.y);
-  f32 inv_slope_2 =
-      (triangle->v2.x - triangle->v1.x) / (triangle->v2.y - triangle->v1.y);
-
-  f32 x1 = triangle->v2.x;
-  f32 x2 = triangle->v2.x;
-  if (intersection.max.y < triangle->v2.y) {
-    x1 -= inv_slope_1 * (triangle->v2.y - intersection.max.y);
-    x2 -= inv_slope_2 * (triangle->v2.y - intersection.max.y);
-  }
-
-  u8 *dst_start =
-      dst->data + f32_to_u32_round_down(intersection.min.x) * dst->channels +
-      f32_to_u32_round_down(intersection.max.y) * dst->width * dst->channels;
-  depthbuffer += f32_to_u32_round_down(intersection.min.x) +
-                 f32_to_u32_round_down(intersection.max.y) * dst->width;
-  for (u32 y = copy_area_hight; 0 < y; y--) {
-    u8 *dst_row = dst_start;
-    f32 *depth_row = depthbuffer;
-    f32 x1_bound = MIN(MAX(x1, intersection.min.x), intersection.max.x);
-    f32 x2_bound = MIN(MAX(x2, intersection.min.x), intersection.max.x);
-    f32 line_start = MIN(x1_bound, x2_bound);
-    f32 line_end = MAX(x1_bound, x2_bound);
-    dst_row +=
-        f32_to_u32_round_down(line_start - intersection.min.x) * dst->channels;
-    depth_row += f32_to_u32_round_down(line_start - intersection.min.x);
-
-    u32 line_width = f32_to_u32_round_down(line_end - line_start);
-    for (u32 x = 0; x < line_width; x++) {
-      V2 p = {line_start + (f32)x, intersection.min.y + (f32)y};
-      V3 w = calculate_interpolation(orig_triangle, p);
-      f32 depth = w.x * orig_triangle->v0.z + w.y * orig_triangle->v1.z +
-                  w.z * orig_triangle->v2.z;
-      f32 *current_depth = depth_row + x;
-      if (*current_depth < depth) {
-        *current_depth = depth;
-
-        V3 normal =
-            v3_add(v3_add(v3_mul(orig_triangle->v0_vertex->normal, w.x),
-                          v3_mul(orig_triangle->v1_vertex->normal, w.y)),
-                   v3_mul(orig_triangle->v2_vertex->normal, w.z));
-        u32 normal_color = (u32)(fabs(normal.x * 255.0)) << 16 |
-                           (u32)(fabs(normal.y * 255.0)) << 8 |
-                           (u32)(fabs(normal.z * 255.0)) << 0;
-
-        u32 *dst_color = (u32 *)(dst_row + x * dst->channels);
-        // *dst_color = color;
-        *dst_color = normal_color;
-      }
-    }
-    x1 -= inv_slope_1;
-    x2 -= inv_slope_2;
-    dst_start -= dst->width * dst->channels;
-    depthbuffer -= dst->width;
-  }
-}
-
-// Draw a triangle assuming vertices are in the CCW order.
-void draw_triangle_standard(f32 *depthbuffer, BitMap *dst, Rect *rect_dst,
-                            u32 color, Triangle triangle, CullMode cullmode) {
-  bool is_ccw = triangle_ccw(&triangle);
-  switch (cullmode) {
-  case CCW:
-    if (!is_ccw)
-      return;
-    break;
-  case CW:
-    if (is_ccw)
-      return;
-    break;
-  case None:
-    break;
-  }
-
-  AABB aabb_tri = triangle_aabb(&triangle);
-
-  AABB aabb_dst;
-  if (rect_dst) {
-    ASSERT((rect_dst->width <= dst->width), "Invalid blit rect_dst");
-    ASSERT((rect_dst->hight <= dst->hight), "Invalid blit rect_dst");
-    aabb_dst = rect_aabb(rect_dst);
-  } else {
-    aabb_dst = (AABB){{0.0, 0.0}, {dst->width, dst->hight}};
-  }
-
-  if (!aabb_intersect(&aabb_tri, &aabb_dst))
-    return;
-
-  AABB intersection = aabb_intersection(&aabb_tri, &aabb_dst);
-
-  V3 s_v0;
-  V3 s_v1;
-  V3 s_v2;
-
-  if (triangle.v0.y < triangle.v1.y) {
-    if (triangle.v1.y < triangle.v2.y) {
-      s_v0 = triangle.v0;
-      s_v1 = triangle.v1;
-      s_v2 = triangle.v2;
-    } else {
-      if (triangle.v0.y < triangle.v2.y) {
-        s_v0 = triangle.v0;
-        s_v1 = triangle.v2;
-        s_v2 = triangle.v1;
-      } else {
-        s_v0 = triangle.v2;
-        s_v1 = triangle.v0;
-        s_v2 = triangle.v1;
-      }
-    }
-  } else {
-    if (triangle.v0.y < triangle.v2.y) {
-      s_v0 = triangle.v1;
-      s_v1 = triangle.v0;
-      s_v2 = triangle.v2;
-    } else {
-      if (triangle.v1.y < triangle.v2.y) {
-        s_v0 = triangle.v1;
-        s_v1 = triangle.v2;
-        s_v2 = triangle.v0;
-      } else {
-        s_v0 = triangle.v2;
-        s_v1 = triangle.v1;
-        s_v2 = triangle.v0;
-      }
-    }
-  }
-  ASSERT((s_v0.y <= s_v1.y && s_v1.y <= s_v2.y),
-         "Vertices are not sorted: s_v2.y: %f, s_v1.y: %f, s_v0.y: %f", s_v2.y,
-         s_v1.y, s_v0.y);
-
-  Triangle sorted_triangle = {
-      .v0 = s_v0,
-      .v1 = s_v1,
-      .v2 = s_v2,
-  };
-  if (s_v1.y == s_v2.y) {
-    draw_triangle_flat_bottom(depthbuffer, dst, &intersection, color,
-                              &sorted_triangle, &triangle);
-    return;
-  }
-  if (s_v0.y == s_v1.y) {
-    draw_triangle_flat_top(depthbuffer, dst, &intersection, color,
-                           &sorted_triangle, &triangle);
-    return;
-  }
-
-  V3 v4 = {
-      .x = s_v0.x + ((s_v1.y - s_v0.y) / (s_v2.y - s_v0.y)) * (s_v2.x - s_v0.x),
-      .y = s_v1.y,
-      .z = 0.0,
-  };
-
-  V3 w = calculate_interpolation(&sorted_triangle, v4.xy);
-  v4.z = s_v0.z * w.x + s_v1.z * w.y + s_v2.z * w.z;
-
-  Triangle flat_bottom = {
-      .v0 = s_v0,
-      .v1 = s_v1,
-      .v2 = v4,
-  };
-  draw_triangle_flat_bottom(depthbuffer, dst, &intersection, color,
-                            &flat_bottom, &triangle);
-  Triangle flat_top = {
-      .v0 = s_v1,
-      .v1 = v4,
-      .v2 = s_v2,
-  };
-  draw_triangle_flat_top(depthbuffer, dst, &intersection, color, &flat_top,
-                         &triangle);
-}
-
-void draw_triangle_barycentric(f32 *depthbuffer, BitMap *dst, Rect *rect_dst,
-                               u32 color, Triangle triangle,
-                               CullMode cullmode) {
-  bool is_ccw = triangle_ccw(&triangle);
-  switch (cullmode) {
-  case CCW:
-    if (!is_ccw)
-      return;
-    break;
-  case CW:
-    if (is_ccw)
-      return;
-    break;
-  case None:
-    break;
-  }
-
-  AABB aabb_tri = triangle_aabb(&triangle);
-
-  AABB aabb_dst;
-  u8 *dst_start;
-  if (rect_dst) {
-    ASSERT((rect_dst->width <= dst->width), "Invalid blit rect_dst");
-    ASSERT((rect_dst->hight <= dst->hight), "Invalid blit rect_dst");
-    aabb_dst = rect_aabb(rect_dst);
-    dst_start = dst->data + (u32)(rect_dst->pos.x - rect_dst->width / 2.0) +
-                (u32)(rect_dst->pos.y - rect_dst->hight / 2.0) * dst->width *
-                    dst->channels;
-  } else {
-    aabb_dst = (AABB){{0.0, 0.0}, {dst->width, dst->hight}};
-    dst_start = dst->data;
-  }
-
-  if (!aabb_intersect(&aabb_tri, &aabb_dst))
-    return;
-
-  AABB intersection = aabb_intersection(&aabb_tri, &aabb_dst);
-
-  u32 copy_area_width = aabb_width(&intersection);
-  u32 copy_area_hight = aabb_hight(&intersection);
-  if (copy_area_width == 0 && copy_area_hight == 0)
-    return;
-
-  V2 dst_start_offset = v2_sub(intersection.min, aabb_dst.min);
-  dst_start += (u32)dst_start_offset.x * dst->channels +
-               (u32)dst_start_offset.y * (dst->width * dst->channels);
-
-  for (u32 y = 0; y < copy_area_hight; y++) {
-    u8 *dst_row = dst_start + y * (dst->width * dst->channels);
-    for (u32 x = 0; x < copy_area_width; x++) {
-      V2 p = {intersection.min.x + (f32)x, intersection.min.y + (f32)y};
-
-      V2 v0v1 = v2_sub(triangle.v1.xy, triangle.v0.xy);
-      V2 v0p = v2_sub(p, triangle.v0.xy);
-
-      V2 v1v2 = v2_sub(triangle.v2.xy, triangle.v1.xy);
-      V2 v1p = v2_sub(p, triangle.v1.xy);
-
-      V2 v2v0 = v2_sub(triangle.v0.xy, triangle.v2.xy);
-      V2 v2p = v2_sub(p, triangle.v2.xy);
-
-      f32 c1 = v2_perp_dot(v0v1, v0p);
-      f32 c2 = v2_perp_dot(v1v2, v1p);
-      f32 c3 = v2_perp_dot(v2v0, v2p);
-
-      bool render = false;
-      switch (cullmode) {
-      case CW:
-        render = c1 >= 0.0 && c2 >= 0.0 && c3 >= 0.0;
-        break;
-      case CCW:
-        render = c1 <= 0.0 && c2 <= 0.0 && c3 <= 0.0;
-        break;
-      case None:
-        render = (c1 >= 0.0 && c2 >= 0.0 && c3 >= 0.0) ||
-                 (c1 <= 0.0 && c2 <= 0.0 && c3 <= 0.0);
-        break;
-      }
-      if (render) {
-        V3 w = calculate_interpolation(&triangle, p);
-        f32 depth =
-            w.x * triangle.v0.z + w.y * triangle.v1.z + w.z * triangle.v2.z;
-
-        f32 *current_depth = depthbuffer + (u32)(intersection.min.x) +
-                             (u32)(intersection.min.y) * dst->width + x +
-                             y * dst->width;
-        if (*current_depth < depth) {
-          *current_depth = depth;
-
-          V3 normal = v3_add(v3_add(v3_mul(triangle.v0_vertex->normal, w.x),
-                                    v3_mul(triangle.v1_vertex->normal, w.y)),
-                             v3_mul(triangle.v2_vertex->normal, w.z));
-          u32 normal_color = (u32)(fabs(normal.x * 255.0)) << 16 |
-                             (u32)(fabs(normal.y * 255.0)) << 8 |
-                             (u32)(fabs(normal.z * 255.0)) << 0;
-
-          u32 *dst_color = (u32 *)(dst_row + x * dst->channels);
-          // *dst_color = color;
-          *dst_color = normal_color;
-        }
-      }
-    }
-  }
-}
-
 void draw_char(BitMap *dst, Rect *rect_dst, Font *font, char c, u32 color,
                V2 pos) {
   BitMap font_bm = {
@@ -856,10 +462,33 @@ void camera_update(Camera *camera, f32 dt) {
   camera->position = v3_add(camera->position, v4_to_v3(camera_vel_v4_rotated));
 }
 
+#define CAMERA_NEAR 0.1
+#define CAMERA_FAR 1000.0
+
+Mat4 camera_perspective() {
+  return mat4_perspective(70.0 / 180.0 * 3.14,
+                          (f32)WINDOW_WIDTH / (f32)WINDOW_HIGHT, CAMERA_NEAR,
+                          CAMERA_FAR);
+}
+
+// Depth of the points on the near plane, the nearest depth that can be drawn.
+f32 camera_max_depth() {
+  Mat4 perspective = camera_perspective();
+  V4 near = mat4_mul_v4(&perspective, (V4){0.0, 0.0, CAMERA_NEAR, 1.0});
+  return near.z / near.w;
+}
+
+// Camera position in the model space.
+V3 camera_model_position(Camera *camera, Mat4 *model_transform) {
+  Mat4 c_transform = camera_transform(camera);
+  Mat4 model_view = mat4_mul(&c_transform, model_transform);
+  Mat4 view_model = mat4_inverse(&model_view);
+  return v4_to_v3(view_model.t);
+}
+
 Mat4 calculate_mvp(Camera *camera, Mat4 *model_transform) {
   Mat4 c_transform = camera_transform(camera);
-  Mat4 perspective = mat4_perspective(
-      70.0 / 180.0 * 3.14, (f32)WINDOW_WIDTH / (f32)WINDOW_HIGHT, 0.1, 1000.0);
+  Mat4 perspective = camera_perspective();
 
   Mat4 model_view = mat4_mul(&c_transform, model_transform);
   return mat4_mul(&perspective, &model_view);
@@ -871,7 +500,11 @@ typedef struct {
   SDL_Window *window;
 
   SDL_Surface *surface;
-  BitMap surface_bm;
+  // Frames are drawn to the render target. With huge pages it is mapped by
+  // the game, `target_size` is its size and it is copied to the window
+  // surface, otherwise it is the window surface.
+  BitMap target_bm;
+  u64 target_size;
   Rect surface_rect;
 
   bool stop;
@@ -885,8 +518,18 @@ typedef struct {
   V2 rect_vel;
 
   Camera camera;
-  enum { Standard, Barycentric } triangle_mode;
+  TriangleMode triangle_mode;
   bool draw_depth;
+  bool tiled;
+  bool hiz;
+  DepthFormat depth_format;
+  bool visibility;
+  bool backface_culling;
+  bool lod;
+  u32 lod_level;
+  RasterKernel raster_kernel;
+
+  ThreadPool thread_pool;
 
   BitMap bm;
   Font font;
@@ -900,13 +543,27 @@ void update_window_surface(Game *game) {
   game->surface = SDL_GetWindowSurface(game->window);
   ASSERT(game->surface, "SDL error: %s", SDL_GetError());
 
-  BitMap surface_bm = {
-      .data = game->surface->pixels,
+  u8 *target = game->surface->pixels;
+  if (GAME_MEMORY_FLAGS & MemoryHugePages) {
+    u64 target_size = (u64)game->surface->w * game->surface->h * 4;
+    if (game->target_size != target_size) {
+      if (game->target_size)
+        memory_unmap(game->target_bm.data, game->target_size,
+                     GAME_MEMORY_FLAGS);
+      game->target_bm.data = memory_map(target_size, GAME_MEMORY_FLAGS);
+      ASSERT(game->target_bm.data, "Failed to map the render target");
+      game->target_size = target_size;
+    }
+    target = game->target_bm.data;
+  }
+
+  BitMap target_bm = {
+      .data = target,
       .width = game->surface->w,
       .hight = game->surface->h,
       .channels = 4,
   };
-  game->surface_bm = surface_bm;
+  game->target_bm = target_bm;
 
   Rect surface_rect = {
       .pos = {(f32)game->surface->w / 2.0, (f32)game->surface->h / 2.0},
@@ -917,7 +574,7 @@ void update_window_surface(Game *game) {
 }
 
 void init(Game *game) {
-  if (!init_memory(&game->memory)) {
+  if (!init_memory(&game->memory, GAME_MEMORY_FLAGS)) {
     exit(1);
   }
 
@@ -964,15 +621,43 @@ void init(Game *game) {
   camera_init(&game->camera);
   game->triangle_mode = Standard;
   game->draw_depth = false;
+  game->tiled = true;
+  game->hiz = true;
+  game->depth_format = DepthF32;
+  game->visibility = false;
+  game->backface_culling = true;
+  game->lod = true;
+  game->lod_level = 0;
+  game->raster_kernel = raster_best_kernel();
+  raster_use_kernel(game->raster_kernel);
+  INFO("Using %s raster kernel", raster_kernel_names[game->raster_kernel]);
+  mat4_project_batch_init();
+
+  thread_pool_init(&game->thread_pool, cpu_count() - 1);
+  if (!init_thread_memory(&game->memory, game->thread_pool.threads_num + 1)) {
+    exit(1);
+  }
 
   game->bm = load_bitmap(&game->memory, "assets/a.png");
   game->font = load_font(&game->memory, "assets/font.ttf", 24.0, 512, 512);
-  game->model = load_model(&game->memory, "assets/monkey.obj");
+  // The mesh file is made by the converter, see README.
+  if (!load_mesh("assets/monkey.mesh", &game->model) &&
+      !load_model(&game->memory, &game->thread_pool, "assets/monkey.obj",
+                  MODEL_LOAD_DEFAULT, &game->model)) {
+    exit(1);
+  }
+  // Loading is over, give back the pages its scratch memory used.
+  frame_reset(&game->memory);
+  memory_trim(&game->memory);
   game->model_rotation = 0.0;
   game->model_transform = mat4_idendity();
 }
 
 void destroy(Game *game) {
+  memory_report(&game->memory);
+  thread_pool_destroy(&game->thread_pool);
+  if (game->target_size)
+    memory_unmap(game->target_bm.data, game->target_size, GAME_MEMORY_FLAGS);
   SDL_DestroyWindow(game->window);
   SDL_Quit();
 }
@@ -1035,9 +720,36 @@ void run(Game *game) {
       case SDLK_2:
         game->triangle_mode = Barycentric;
         break;
+      case SDLK_6:
+        game->triangle_mode = Fixed;
+        break;
       case SDLK_3:
         game->draw_depth = !game->draw_depth;
         break;
+      case SDLK_4:
+        game->tiled = !game->tiled;
+        break;
+      case SDLK_5:
+        do {
+          game->raster_kernel = (game->raster_kernel + 1) % 3;
+        } while (!raster_kernel_supported(game->raster_kernel));
+        raster_use_kernel(game->raster_kernel);
+        break;
+      case SDLK_7:
+        game->hiz = !game->hiz;
+        break;
+      case SDLK_8:
+        game->depth_format = (game->depth_format + 1) % 3;
+        break;
+      case SDLK_9:
+        game->visibility = !game->visibility;
+        break;
+      case SDLK_0:
+        game->backface_culling = !game->backface_culling;
+        break;
+      case SDLK_l:
+        game->lod = !game->lod;
+        break;
       }
       break;
     default:
@@ -1064,71 +776,66 @@ void run(Game *game) {
     game->rect_vel.y *= -1;
   }
 
-  f32 *depthbuffer = frame_alloc_array((&game->memory), f32,
-                                       game->surface->w * game->surface->h);
-  memset(depthbuffer, 0, game->surface->w * game->surface->h * 4);
-
-  SDL_FillRect(game->surface, 0, 0);
+  DepthBuffer depthbuffer =
+      depth_buffer_create(&game->memory, game->surface->w, game->surface->h,
+                          game->depth_format, camera_max_depth(), game->hiz,
+                          game->visibility);
 
-  Mat4 c_transform = camera_transform(&game->camera);
-  Mat4 perspective = mat4_perspective(
-      70.0 / 180.0 * 3.14, (f32)WINDOW_WIDTH / (f32)WINDOW_HIGHT, 0.1, 1000.0);
+  if (game->target_size)
+    memset(game->target_bm.data, 0, game->target_size);
+  else
+    SDL_FillRect(game->surface, 0, 0);
 
   Mat4 mvp = calculate_mvp(&game->camera, &game->model_transform);
-  for (u32 i = 0; i < game->model.vertices_num; i += 3) {
-#if 0
-    V4 v0 = v3_to_v4(game->model.vertices[i].position, 1.0);
-    V4 v1 = v3_to_v4(game->model.vertices[i + 1].position, 1.0);
-    V4 v2 = v3_to_v4(game->model.vertices[i + 2].position, 1.0);
-    INFO("model v0 (%f %f %f), v1 (%f %f %f), v2 (%f %f %f)", v0.x, v0.y,
-    v0.z,
-         v1.x, v1.y, v1.z, v2.x, v2.y, v2.z);
-
-    V4 v0_world = mat4_mul_v4(&game->model_transform, v0);
-    V4 v1_world = mat4_mul_v4(&game->model_transform, v1);
-    V4 v2_world = mat4_mul_v4(&game->model_transform, v2);
-    INFO("world v0 (%f %f %f), v1 (%f %f %f), v2 (%f %f %f)", v0_world.x,
-         v0_world.y, v0_world.z, v1_world.x, v1_world.y, v1_world.z,
-         v2_world.x, v2_world.y, v2_world.z);
-
-    V4 v0_camera = mat4_mul_v4(&c_transform, v0_world);
-    V4 v1_camera = mat4_mul_v4(&c_transform, v1_world);
-    V4 v2_camera = mat4_mul_v4(&c_transform, v2_world);
-    INFO("camera v0 (%f %f %f), v1 (%f %f %f), v2 (%f %f %f)", v0_camera.x,
-         v0_camera.y, v0_camera.z, v1_camera.x, v1_camera.y, v1_camera.z,
-         v2_camera.x, v2_camera.y, v2_camera.z);
-
-    V4 v0_clip = mat4_mul_v4(&perspective, v0_world);
-    V4 v1_clip = mat4_mul_v4(&perspective, v1_world);
-    V4 v2_clip = mat4_mul_v4(&perspective, v2_world);
-    INFO("clip v0 (%f %f %f), v1 (%f %f %f), v2 (%f %f %f)", v0_clip.x,
-         v0_clip.y, v0_clip.z, v1_clip.x, v1_clip.y, v1_clip.z, v2_clip.x,
-         v2_clip.y, v2_clip.z);
-#endif
-
-    Triangle t = vertices_to_triangle(
-        &game->model.vertices[i], &game->model.vertices[i + 1],
-        &game->model.vertices[i + 2], &mvp, WINDOW_WIDTH, WINDOW_HIGHT);
-    u32 color =
-        (f32)(0xFFAA33FF) * (f32)(i + 1) / (f32)(game->model.vertices_num + 1);
-    switch (game->triangle_mode) {
-    case Standard:
-      draw_triangle_standard(depthbuffer, &game->surface_bm, NULL, color, t,
-                             CCW);
-      break;
-    case Barycentric:
-      draw_triangle_barycentric(depthbuffer, &game->surface_bm, NULL, color, t,
-                                CCW);
-      break;
+  f32 max_depth = camera_max_depth();
+  Frustum frustum = frustum_from_mvp(&mvp, max_depth);
+  Triangle *triangles = NULL;
+  u32 triangles_num = 0;
+  game->lod_level = 0;
+  if (game->lod)
+    game->lod_level = model_select_lod(&game->model, &mvp, WINDOW_WIDTH,
+                                       WINDOW_HIGHT);
+  Model model = model_lod(&game->model, game->lod_level);
+  if (model_in_frustum(&frustum, &model)) {
+    u32 *faces =
+        frame_alloc_array((&game->memory), u32, model.face_planes.faces_num);
+    u32 faces_num = 0;
+    V3 eye = camera_model_position(&game->camera, &game->model_transform);
+    if (model.meshlets) {
+      faces_num = cull_meshlets(&model, &frustum, eye, game->backface_culling,
+                                faces);
+    } else if (game->backface_culling) {
+      faces_num = cull_backfaces_batch(&model, eye, faces);
+    } else {
+      for (; faces_num < model.face_planes.faces_num; faces_num++)
+        faces[faces_num] = faces_num;
     }
+    triangles_num = project_model(&game->memory, &model, faces, faces_num,
+                                  &mvp, max_depth, WINDOW_WIDTH, WINDOW_HIGHT,
+                                  &triangles);
+  }
+
+  if (game->tiled) {
+    draw_triangles_tiled(&game->memory, &game->thread_pool, &depthbuffer,
+                         &game->target_bm, triangles, triangles_num, CCW,
+                         game->triangle_mode);
+  } else {
+    for (u32 i = 0; i < triangles_num; i++)
+      draw_triangle(&depthbuffer, &game->target_bm, NULL, i, triangles[i],
+                    CCW, game->triangle_mode);
   }
 
+  if (game->visibility)
+    resolve_visibility(&game->thread_pool, &depthbuffer, &game->target_bm,
+                       triangles);
+
   if (game->draw_depth) {
     for (u32 y = 0; y < game->surface_rect.hight; y++) {
       for (u32 x = 0; x < game->surface_rect.width; x++) {
-        u32 *pixel = (u32 *)(game->surface->pixels) + x + y * game->surface->w;
-        f32 *depth = depthbuffer + x + y * game->surface->w;
-        u32 d = (u32)(*depth * 255.0);
+        u32 *pixel = (u32 *)(game->target_bm.data) + x + y * game->surface->w;
+        f32 depth =
+            depth_buffer_unorm(&depthbuffer, x + y * game->surface->w);
+        u32 d = (u32)(depth * 255.0);
         *pixel = d << 16 | d << 8 | d << 0;
       }
     }
@@ -1137,27 +844,69 @@ void run(Game *game) {
   {
     char *buf = frame_alloc((&game->memory), char[70]);
     snprintf(buf, 70, "FPS: %.02f dt: %.5f", 1.0 / game->dt, game->dt);
-    draw_text(&game->surface_bm, &game->surface_rect, &game->font, buf,
+    draw_text(&game->target_bm, &game->surface_rect, &game->font, buf,
               0xFF00FF00, (V2){20.0, 20.0});
   }
 
+  {
+    char *buf = frame_alloc((&game->memory), char[70]);
+    snprintf(buf, 70, "Frame memory: %lu KB Perm memory: %lu KB",
+             frame_memory_last_peak(&game->memory) / 1024,
+             game->memory.perm_memory.end / 1024);
+    draw_text(&game->target_bm, &game->surface_rect, &game->font, buf,
+              0xFF00FF00, (V2){20.0, 50.0});
+  }
+
   {
     char *buf = frame_alloc((&game->memory), char[70]);
     snprintf(buf, 70, "Camera: x: %.02f y: %.02f z: %.02f",
              game->camera.position.x, game->camera.position.y,
              game->camera.position.z);
-    draw_text(&game->surface_bm, &game->surface_rect, &game->font, buf,
+    draw_text(&game->target_bm, &game->surface_rect, &game->font, buf,
               0xFF00FF00, (V2){20.0, game->surface_rect.hight - 20.0});
   }
 
   {
     char *buf = frame_alloc((&game->memory), char[70]);
     snprintf(buf, 70, "Triangle type: %s Show depth: %s",
-             game->triangle_mode == Standard ? "Standard" : "Barycentric",
+             triangle_mode_names[game->triangle_mode],
              game->draw_depth ? "true" : "false");
-    draw_text(&game->surface_bm, &game->surface_rect, &game->font, buf,
+    draw_text(&game->target_bm, &game->surface_rect, &game->font, buf,
               0xFF00FF00, (V2){20.0, game->surface_rect.hight - 50.0});
   }
 
+  {
+    char *buf = frame_alloc((&game->memory), char[70]);
+    snprintf(buf, 70, "Tiled: %s Kernel: %s HiZ: %s Depth: %s",
+             game->tiled ? "true" : "false",
+             raster_kernel_names[game->raster_kernel],
+             game->hiz ? "true" : "false",
+             depth_format_names[game->depth_format]);
+    draw_text(&game->target_bm, &game->surface_rect, &game->font, buf,
+              0xFF00FF00, (V2){20.0, game->surface_rect.hight - 80.0});
+  }
+
+  {
+    char *buf = frame_alloc((&game->memory), char[70]);
+    snprintf(buf, 70, "Visibility buffer: %s Backface culling: %s",
+             game->visibility ? "true" : "false",
+             game->backface_culling ? "true" : "false");
+    draw_text(&game->target_bm, &game->surface_rect, &game->font, buf,
+              0xFF00FF00, (V2){20.0, game->surface_rect.hight - 110.0});
+  }
+
+  {
+    char *buf = frame_alloc((&game->memory), char[70]);
+    snprintf(buf, 70, "LOD: %s Level: %d", game->lod ? "true" : "false",
+             game->lod_level);
+    draw_text(&game->target_bm, &game->surface_rect, &game->font, buf,
+              0xFF00FF00, (V2){20.0, game->surface_rect.hight - 140.0});
+  }
+
+  if (game->target_size)
+    for (u32 y = 0; y < game->target_bm.hight; y++)
+      memcpy((u8 *)game->surface->pixels + y * game->surface->pitch,
+             game->target_bm.data + y * game->target_bm.width * 4,
+             game->target_bm.width * 4);
   SDL_UpdateWindowSurface(game->window);
 }
@@ -443,4 +443,118 @@ static inline Mat4 mat4_inverse(Mat4 *m) {
   return result;
 }
 
+// Structure of arrays vectors for the batched transforms.
+typedef struct {
+  f32 *x;
+  f32 *y;
+  f32 *z;
+} V3Array;
+
+typedef struct {
+  f32 *x;
+  f32 *y;
+  f32 *z;
+  f32 *w;
+} V4Array;
+
+// Transforms `num` positions, with w of 1, by `m` to `clip` and maps them to
+// the screen with the perspective divide and the viewport mapping to `screen`.
+// All variants give the same results as `mat4_mul_v4` followed by the
+// mapping below.
+void mat4_project_batch_scalar(Mat4 *m, V3Array in, u32 num, f32 width,
+                               f32 hight, V4Array clip, V3Array screen) {
+  f32 half_width = width * 0.5f;
+  f32 half_hight = hight * 0.5f;
+  for (u32 i = 0; i < num; i++) {
+    f32 x = in.x[i];
+    f32 y = in.y[i];
+    f32 z = in.z[i];
+    f32 cx = m->i.x * x + m->j.x * y + m->k.x * z + m->t.x;
+    f32 cy = m->i.y * x + m->j.y * y + m->k.y * z + m->t.y;
+    f32 cz = m->i.z * x + m->j.z * y + m->k.z * z + m->t.z;
+    f32 cw = m->i.w * x + m->j.w * y + m->k.w * z + m->t.w;
+    clip.x[i] = cx;
+    clip.y[i] = cy;
+    clip.z[i] = cz;
+    clip.w[i] = cw;
+    screen.x[i] = (cx / cw + 1.0f) * half_width;
+    screen.y[i] = (cy / cw + 1.0f) * half_hight;
+    screen.z[i] = cz / cw;
+  }
+}
+
+typedef void (*Mat4ProjectBatchFn)(Mat4 *m, V3Array in, u32 num, f32 width,
+                                   f32 hight, V4Array clip, V3Array screen);
+
+// SSE is part of the x86_64 baseline, only AVX is checked at runtime.
+#if defined(__x86_64__)
+#include <immintrin.h>
+
+#define MATH_SIMD
+
+// Rows of the matrix are broadcast, so every lane transforms one position.
+#define MAT4_PROJECT_BATCH_BODY(T, W, set1, loadu, storeu, add, mul, div)      \
+  T half_width = set1(width * 0.5f);                                           \
+  T half_hight = set1(hight * 0.5f);                                           \
+  T one = set1(1.0f);                                                          \
+  T rows[4][4];                                                                \
+  for (u32 r = 0; r < 4; r++) {                                                \
+    rows[r][0] = set1(m->v[r]);                                                \
+    rows[r][1] = set1(m->v[4 + r]);                                            \
+    rows[r][2] = set1(m->v[8 + r]);                                            \
+    rows[r][3] = set1(m->v[12 + r]);                                           \
+  }                                                                            \
+  u32 i = 0;                                                                   \
+  for (; i + W <= num; i += W) {                                               \
+    T x = loadu(in.x + i);                                                     \
+    T y = loadu(in.y + i);                                                     \
+    T z = loadu(in.z + i);                                                     \
+    T c[4];                                                                    \
+    for (u32 r = 0; r < 4; r++)                                                \
+      c[r] = add(add(add(mul(rows[r][0], x), mul(rows[r][1], y)),              \
+                     mul(rows[r][2], z)),                                      \
+                 rows[r][3]);                                                  \
+    storeu(clip.x + i, c[0]);                                                  \
+    storeu(clip.y + i, c[1]);                                                  \
+    storeu(clip.z + i, c[2]);                                                  \
+    storeu(clip.w + i, c[3]);                                                  \
+    storeu(screen.x + i, mul(add(div(c[0], c[3]), one), half_width));          \
+    storeu(screen.y + i, mul(add(div(c[1], c[3]), one), half_hight));          \
+    storeu(screen.z + i, div(c[2], c[3]));                                     \
+  }                                                                            \
+  V3Array in_tail = {in.x + i, in.y + i, in.z + i};                            \
+  V4Array clip_tail = {clip.x + i, clip.y + i, clip.z + i, clip.w + i};        \
+  V3Array screen_tail = {screen.x + i, screen.y + i, screen.z + i};            \
+  mat4_project_batch_scalar(m, in_tail, num - i, width, hight, clip_tail,      \
+                            screen_tail);
+
+void mat4_project_batch_sse(Mat4 *m, V3Array in, u32 num, f32 width,
+                            f32 hight, V4Array clip, V3Array screen) {
+  MAT4_PROJECT_BATCH_BODY(__m128, 4, _mm_set1_ps, _mm_loadu_ps, _mm_storeu_ps,
+                          _mm_add_ps, _mm_mul_ps, _mm_div_ps)
+}
+
+__attribute__((target("avx"))) void
+mat4_project_batch_avx(Mat4 *m, V3Array in, u32 num, f32 width, f32 hight,
+                       V4Array clip, V3Array screen) {
+  MAT4_PROJECT_BATCH_BODY(__m256, 8, _mm256_set1_ps, _mm256_loadu_ps,
+                          _mm256_storeu_ps, _mm256_add_ps, _mm256_mul_ps,
+                          _mm256_div_ps)
+}
+#endif
+
+// Variant used for the batched transforms. Selected at startup with
+// `mat4_project_batch_init` and must not be changed while rendering.
+Mat4ProjectBatchFn mat4_project_batch = mat4_project_batch_scalar;
+
+// Picks the widest SIMD variant the CPU supports.
+void mat4_project_batch_init() {
+#ifdef MATH_SIMD
+  __builtin_cpu_init();
+  mat4_project_batch = __builtin_cpu_supports("avx") != 0
+                           ? mat4_project_batch_avx
+                           : mat4_project_batch_sse;
+#endif
+}
+
 #endif
@@ -2,68 +2,292 @@
 #define SOFTY_MEMORY
 
 #include "defines.h"
+#include "log.h"
 
 #include <stdalign.h>
 #include <stdio.h>
 #include <sys/mman.h>
 
-#define PERM_MEMORY_SIZE 1024 * 1024 * 32
-#define FRAME_MEMORY_SIZE 1024 * 1024 * 4
+// Chunks reserve address space up front and commit pages as they grow, so
+// pointers into them stay valid and only the used memory is backed. Pages
+// above the peak of the last MEMORY_DECOMMIT_FRAMES frames are given back
+// when that peak is under half of the committed memory, and `memory_trim`
+// gives back the pages above the current ends at scene boundaries.
+// Emscripten has no address space to spare and commits it all at once.
+#ifdef __EMSCRIPTEN__
+#define PERM_MEMORY_RESERVE (1024ull * 1024 * 32)
+#define FRAME_MEMORY_RESERVE (1024ull * 1024 * 16)
+#define THREAD_FRAME_MEMORY_RESERVE (1024ull * 1024 * 4)
+#else
+#define PERM_MEMORY_RESERVE (1024ull * 1024 * 1024 * 64)
+#define FRAME_MEMORY_RESERVE (1024ull * 1024 * 1024 * 16)
+#define THREAD_FRAME_MEMORY_RESERVE (1024ull * 1024 * 1024 * 1)
+#endif
+// Step of committing pages in a chunk, huge pages are committed whole.
+#define MEMORY_COMMIT_SIZE (1024ull * 1024)
+// Frames the peak is taken over before decommitting, so the pages of a
+// spike are kept for a while instead of being faulted in again.
+#define MEMORY_DECOMMIT_FRAMES 128
+#define HUGE_PAGE_SIZE (1024ull * 1024 * 2)
+// Committed at init with MemoryPrefault.
+#define PERM_MEMORY_PREFAULT (1024ull * 1024 * 32)
+#define FRAME_MEMORY_PREFAULT (1024ull * 1024 * 16)
+#define THREAD_FRAME_MEMORY_PREFAULT (1024ull * 1024 * 2)
+
+typedef enum {
+  // Back the memory with transparent huge pages, so scattered accesses to
+  // large buffers miss the TLB less.
+  MemoryHugePages = 1 << 0,
+  // Fault pages in as they are committed, so their first use does not stall.
+  MemoryPrefault = 1 << 1,
+} MemoryFlags;
 
 typedef struct {
   u8 *memory;
   u64 end;
+  // Reserved bytes.
   u64 capacity;
+  u64 committed;
+  u32 flags;
+  // Highest end since the last `frame_reset`, during the frame before it
+  // and since the start.
+  u64 frame_peak;
+  u64 last_frame_peak;
+  u64 peak;
+  // Highest end over the frames of the current decommit window.
+  u64 window_peak;
+  u32 window_frames;
+  // Committed bytes which are never given back, the prefaulted ones.
+  u64 retained;
 } MemoryChunk;
 
+// Frame memory of one thread. Each one is on its own cache line, so threads
+// bumping their chunks do not share lines.
+typedef struct {
+  alignas(64) MemoryChunk chunk;
+} ThreadFrameMemory;
+
 typedef struct {
   MemoryChunk perm_memory;
   MemoryChunk frame_memory;
+  ThreadFrameMemory *thread_frames;
+  u32 thread_frames_num;
+  u32 flags;
 } Memory;
 
-bool init_memory(Memory *memory) {
-  u8 *perm_ptr = mmap(NULL, PERM_MEMORY_SIZE, PROT_READ | PROT_WRITE,
-                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
-  if (!perm_ptr) {
+// Maps `size` bytes at an address aligned to `alignment`, huge pages need
+// aligned addresses. The slack around them is unmapped.
+u8 *__memory_map_aligned(u64 size, u64 alignment, i32 prot, i32 flags) {
+  u8 *ptr = mmap(NULL, size + alignment, prot, flags, -1, 0);
+  if (ptr == MAP_FAILED) {
+    return MAP_FAILED;
+  }
+
+  u8 *aligned = (u8 *)(((u64)ptr + alignment - 1) & ~(alignment - 1));
+  if (ptr < aligned) {
+    munmap(ptr, aligned - ptr);
+  }
+  if (aligned < ptr + alignment) {
+    munmap(aligned + size, ptr + alignment - aligned);
+  }
+  return aligned;
+}
+
+// Writes the pages of fresh memory, so they are backed before their first
+// use.
+void __memory_prefault(u8 *ptr, u64 size) {
+#ifdef MADV_POPULATE_WRITE
+  if (!madvise(ptr, size, MADV_POPULATE_WRITE)) {
+    return;
+  }
+#endif
+  for (u64 i = 0; i < size; i += 4096) {
+    ptr[i] = 0;
+  }
+}
+
+bool __chunk_init(MemoryChunk *chunk, u64 capacity, u32 flags) {
+#ifdef __EMSCRIPTEN__
+  u8 *ptr = mmap(NULL, capacity, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  u64 committed = capacity;
+  flags = 0;
+#else
+  // Address space can be limited, take the largest reservation that fits.
+  u64 reserve = capacity;
+  u64 alignment = (flags & MemoryHugePages) ? HUGE_PAGE_SIZE : 4096;
+  i32 map_flags = MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE;
+  u8 *ptr = __memory_map_aligned(capacity, alignment, PROT_NONE, map_flags);
+  while (ptr == MAP_FAILED && MEMORY_COMMIT_SIZE < capacity) {
+    capacity /= 2;
+    ptr = __memory_map_aligned(capacity, alignment, PROT_NONE, map_flags);
+  }
+  if (ptr != MAP_FAILED && capacity < reserve) {
+    WARN("Reserved %lu MB of %lu MB", capacity >> 20, reserve >> 20);
+  }
+  if (ptr != MAP_FAILED && (flags & MemoryHugePages)) {
+    madvise(ptr, capacity, MADV_HUGEPAGE);
+  }
+  u64 committed = 0;
+#endif
+  if (ptr == MAP_FAILED) {
+    return false;
+  }
+
+  MemoryChunk result = {
+      .memory = ptr,
+      .capacity = capacity,
+      .committed = committed,
+      .flags = flags,
+  };
+  *chunk = result;
+  return true;
+}
+
+// Commits the pages of the chunk up to `end`.
+bool __chunk_commit(MemoryChunk *chunk, u64 end) {
+  u64 step = (chunk->flags & MemoryHugePages) ? HUGE_PAGE_SIZE
+                                               : MEMORY_COMMIT_SIZE;
+  u64 committed = (end + step - 1) & ~(step - 1);
+  if (chunk->capacity < committed) {
+    committed = chunk->capacity;
+  }
+  if (committed <= chunk->committed) {
+    return true;
+  }
+  if (mprotect(chunk->memory + chunk->committed, committed - chunk->committed,
+               PROT_READ | PROT_WRITE)) {
+    return false;
+  }
+  if (chunk->flags & MemoryPrefault) {
+    __memory_prefault(chunk->memory + chunk->committed,
+                      committed - chunk->committed);
+  }
+  chunk->committed = committed;
+  return true;
+}
+
+// Gives back the committed pages of the chunk above `end`, but not below
+// `retained`. The pages are reserved again, so their next use commits them.
+void __chunk_decommit(MemoryChunk *chunk, u64 end) {
+#ifndef __EMSCRIPTEN__
+  u64 step = (chunk->flags & MemoryHugePages) ? HUGE_PAGE_SIZE
+                                               : MEMORY_COMMIT_SIZE;
+  if (end < chunk->retained) {
+    end = chunk->retained;
+  }
+  u64 committed = (end + step - 1) & ~(step - 1);
+  if (chunk->committed <= committed) {
+    return;
+  }
+  u8 *ptr = chunk->memory + committed;
+  u64 size = chunk->committed - committed;
+  madvise(ptr, size, MADV_DONTNEED);
+  mprotect(ptr, size, PROT_NONE);
+  chunk->committed = committed;
+#endif
+}
+
+// `flags` are MemoryFlags for all the chunks. With MemoryPrefault the first
+// PERM_MEMORY_PREFAULT and FRAME_MEMORY_PREFAULT bytes are backed right away.
+bool init_memory(Memory *memory, u32 flags) {
+  memory->flags = flags;
+  if (!__chunk_init(&memory->perm_memory, PERM_MEMORY_RESERVE, flags)) {
     return false;
   }
 
-  u8 *frame_ptr = mmap(NULL, FRAME_MEMORY_SIZE, PROT_READ | PROT_WRITE,
-                       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
-  if (!frame_ptr) {
+  if (!__chunk_init(&memory->frame_memory, FRAME_MEMORY_RESERVE, flags)) {
     return false;
   }
 
-  memory->perm_memory.memory = perm_ptr;
-  memory->perm_memory.end = 0;
-  memory->perm_memory.capacity = PERM_MEMORY_SIZE;
+  if (flags & MemoryPrefault) {
+    __chunk_commit(&memory->perm_memory, PERM_MEMORY_PREFAULT);
+    __chunk_commit(&memory->frame_memory, FRAME_MEMORY_PREFAULT);
+    memory->perm_memory.retained = memory->perm_memory.committed;
+    memory->frame_memory.retained = memory->frame_memory.committed;
+  }
 
-  memory->frame_memory.memory = frame_ptr;
-  memory->frame_memory.end = 0;
-  memory->frame_memory.capacity = FRAME_MEMORY_SIZE;
+  memory->thread_frames = NULL;
+  memory->thread_frames_num = 0;
   return true;
 }
 
+// Pages outside of the chunks for buffers that live long and are not freed
+// in bulk, like the render target. With MemoryHugePages explicit huge pages
+// are used when the system has them reserved, transparent ones otherwise.
+void *memory_map(u64 size, u32 flags) {
+#ifndef __EMSCRIPTEN__
+  if (flags & MemoryHugePages) {
+    size = (size + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1);
+    i32 populate = (flags & MemoryPrefault) ? MAP_POPULATE : 0;
+    u8 *ptr = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | populate, -1, 0);
+    if (ptr != MAP_FAILED) {
+      return ptr;
+    }
+
+    ptr = __memory_map_aligned(size, HUGE_PAGE_SIZE, PROT_READ | PROT_WRITE,
+                               MAP_PRIVATE | MAP_ANONYMOUS);
+    if (ptr == MAP_FAILED) {
+      return NULL;
+    }
+    madvise(ptr, size, MADV_HUGEPAGE);
+    if (flags & MemoryPrefault) {
+      __memory_prefault(ptr, size);
+    }
+    return ptr;
+  }
+  i32 populate = (flags & MemoryPrefault) ? MAP_POPULATE : 0;
+#else
+  i32 populate = 0;
+#endif
+  u8 *ptr = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS | populate, -1, 0);
+  return ptr == MAP_FAILED ? NULL : ptr;
+}
+
+// Takes the `size` and `flags` given to `memory_map`.
+void memory_unmap(void *ptr, u64 size, u32 flags) {
+  if (flags & MemoryHugePages) {
+    size = (size + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1);
+  }
+  munmap(ptr, size);
+}
+
 #define perm_alloc(memory, type)                                               \
   __bump_alloc(&memory->perm_memory, sizeof(type), alignof(type))
 
 #define perm_alloc_array(memory, type, num)                                    \
   __bump_alloc(&memory->perm_memory, sizeof(type) * num, alignof(type))
 
+#define perm_alloc_array_aligned(memory, type, num, alignment)                 \
+  __bump_alloc(&memory->perm_memory, sizeof(type) * num, alignment)
+
 #define frame_alloc(memory, type)                                              \
   __bump_alloc(&memory->frame_memory, sizeof(type), alignof(type))
 
 #define frame_alloc_array(memory, type, num)                                    \
   __bump_alloc(&memory->frame_memory, sizeof(type) * num, alignof(type))
 
-#define frame_reset(memory) *memory.frame_memory.end = 0;
+// Frame memory of the thread with index `thread`, see `init_thread_memory`.
+#define thread_frame_alloc(memory, thread, type)                               \
+  __bump_alloc(&memory->thread_frames[thread].chunk, sizeof(type),             \
+               alignof(type))
+
+#define thread_frame_alloc_array(memory, thread, type, num)                    \
+  __bump_alloc(&memory->thread_frames[thread].chunk, sizeof(type) * num,       \
+               alignof(type))
 
 void *__bump_alloc(MemoryChunk *chunk, u64 size, u64 alignment) {
   u64 bytes_aligned =
       ((u64)(chunk->memory + chunk->end) + (alignment - 1)) & ~(alignment - 1);
   u64 bytes_diff = bytes_aligned - (u64)(chunk->memory + chunk->end);
 
-  if (chunk->capacity < chunk->end + bytes_diff + size) {
+  u64 end = chunk->end + bytes_diff + size;
+  if (chunk->capacity < end) {
+    return NULL;
+  }
+  if (chunk->committed < end && !__chunk_commit(chunk, end)) {
     return NULL;
   }
 
@@ -71,7 +295,111 @@ void *__bump_alloc(MemoryChunk *chunk, u64 size, u64 alignment) {
   u8 *r_ptr = chunk->memory + chunk->end;
   chunk->end += size;
 
+  if (chunk->frame_peak < chunk->end) {
+    chunk->frame_peak = chunk->end;
+  }
+  if (chunk->peak < chunk->end) {
+    chunk->peak = chunk->end;
+  }
+
   return r_ptr;
 }
 
+// Gives every thread of a pool with `threads_num` threads, the calling one
+// included, its own frame memory, so threads allocate without locks. The
+// headers are in the perm memory.
+bool init_thread_memory(Memory *memory, u32 threads_num) {
+  memory->thread_frames =
+      perm_alloc_array(memory, ThreadFrameMemory, threads_num);
+  if (!memory->thread_frames) {
+    return false;
+  }
+
+  for (u32 i = 0; i < threads_num; i++) {
+    MemoryChunk *chunk = &memory->thread_frames[i].chunk;
+    if (!__chunk_init(chunk, THREAD_FRAME_MEMORY_RESERVE, memory->flags)) {
+      return false;
+    }
+    if (memory->flags & MemoryPrefault) {
+      __chunk_commit(chunk, THREAD_FRAME_MEMORY_PREFAULT);
+      chunk->retained = chunk->committed;
+    }
+  }
+  memory->thread_frames_num = threads_num;
+  return true;
+}
+
+void __chunk_frame_reset(MemoryChunk *chunk, u64 end) {
+  if (chunk->window_peak < chunk->frame_peak) {
+    chunk->window_peak = chunk->frame_peak;
+  }
+  if (MEMORY_DECOMMIT_FRAMES <= ++chunk->window_frames) {
+    if (chunk->window_peak < chunk->committed / 2) {
+      __chunk_decommit(chunk, chunk->window_peak);
+    }
+    chunk->window_peak = 0;
+    chunk->window_frames = 0;
+  }
+  chunk->end = end;
+  chunk->last_frame_peak = chunk->frame_peak;
+  chunk->frame_peak = end;
+}
+
+// Frees everything allocated in the frame memory of all the threads and
+// starts the frame peaks of all the chunks over. Every
+// MEMORY_DECOMMIT_FRAMES frames, chunks using less than half of their
+// committed memory give back the pages above their peak.
+void frame_reset(Memory *memory) {
+  __chunk_frame_reset(&memory->perm_memory, memory->perm_memory.end);
+  __chunk_frame_reset(&memory->frame_memory, 0);
+  for (u32 i = 0; i < memory->thread_frames_num; i++)
+    __chunk_frame_reset(&memory->thread_frames[i].chunk, 0);
+}
+
+// Frame memory used by all the threads during the last frame.
+u64 frame_memory_last_peak(Memory *memory) {
+  u64 peak = memory->frame_memory.last_frame_peak;
+  for (u32 i = 0; i < memory->thread_frames_num; i++)
+    peak += memory->thread_frames[i].chunk.last_frame_peak;
+  return peak;
+}
+
+// Gives back the committed pages above the current end of every chunk, for
+// scene boundaries after which the memory of the previous scene is not
+// needed.
+void memory_trim(Memory *memory) {
+  __chunk_decommit(&memory->perm_memory, memory->perm_memory.end);
+  __chunk_decommit(&memory->frame_memory, memory->frame_memory.end);
+  for (u32 i = 0; i < memory->thread_frames_num; i++)
+    __chunk_decommit(&memory->thread_frames[i].chunk,
+                     memory->thread_frames[i].chunk.end);
+}
+
+// Logs the peak use of every chunk, to size the memory of a scene.
+void memory_report(Memory *memory) {
+  INFO("Perm memory peak %lu KB, committed %lu KB",
+       memory->perm_memory.peak / 1024, memory->perm_memory.committed / 1024);
+  INFO("Frame memory peak %lu KB, committed %lu KB",
+       memory->frame_memory.peak / 1024, memory->frame_memory.committed / 1024);
+  for (u32 i = 0; i < memory->thread_frames_num; i++)
+    INFO("Thread %d frame memory peak %lu KB, committed %lu KB", i,
+         memory->thread_frames[i].chunk.peak / 1024,
+         memory->thread_frames[i].chunk.committed / 1024);
+}
+
+// Position in a chunk. Restoring it frees everything allocated from the
+// chunk after the mark was made, so temporary allocations in loops and
+// passes do not add up until the next `frame_reset`.
+typedef struct {
+  MemoryChunk *chunk;
+  u64 end;
+} ScratchMark;
+
+ScratchMark scratch_mark(MemoryChunk *chunk) {
+  ScratchMark mark = {.chunk = chunk, .end = chunk->end};
+  return mark;
+}
+
+void scratch_restore(ScratchMark mark) { mark.chunk->end = mark.end; }
+
 #endif
@@ -4,10 +4,12 @@
 #include "log.h"
 #include "math.h"
 #include "memory.h"
+#include "threads.h"
 
 #include <fcntl.h>
 #include <unistd.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sys/stat.h>
 
 typedef struct {
@@ -55,6 +57,16 @@ AABB aabb_intersection(AABB *a, AABB *b) {
   return result;
 }
 
+typedef struct {
+  V3 min;
+  V3 max;
+} AABB3;
+
+typedef struct {
+  V3 center;
+  f32 radius;
+} Sphere;
+
 typedef struct {
   V2 pos;
   f32 width;
@@ -69,6 +81,13 @@ AABB rect_aabb(Rect *rect) {
   return aabb;
 }
 
+typedef struct {
+  u32 width;
+  u32 hight;
+  u32 channels;
+  u8 *data;
+} BitMap;
+
 typedef struct {
   V3 position;
   V3 normal;
@@ -100,207 +119,2373 @@ AABB triangle_aabb(Triangle *triangle) {
   return result;
 }
 
-Triangle vertices_to_triangle(Vertex *v0, Vertex *v1, Vertex *v2, Mat4 *mvp,
-                              f32 window_width, f32 window_hight) {
+// Perspective divide and viewport mapping of a clip space position. Same
+// arithmetic as `mat4_project_batch`.
+V3 clip_to_screen(V4 position, f32 window_width, f32 window_hight) {
+  V3 result = {(position.x / position.w + 1.0f) * (window_width * 0.5f),
+               (position.y / position.w + 1.0f) * (window_hight * 0.5f),
+               position.z / position.w};
+  return result;
+}
+
+// Triangles are clipped in the homogeneous clip space against the near plane,
+// where depth reaches `max_depth`, and against the guard band. Inside of the
+// guard band only the rasterizer clips x/y to the screen, so the screen
+// frustum planes are used only to drop triangles fully outside of the screen.
+// Guard band size in NDC units.
+#define CLIP_GUARD_BAND 8.0
+// A triangle clipped by the near and 4 guard band planes.
+#define CLIP_MAX_VERTICES 8
+#define CLIP_MAX_TRIANGLES (CLIP_MAX_VERTICES - 2)
 
-  V4 v0_position = v3_to_v4(v0->position, 1.0);
-  v0_position = mat4_mul_v4(mvp, v0_position);
-  v0_position = v4_div(v0_position, v0_position.w);
+typedef enum {
+  ClipNear = 1 << 0,
+  ClipGuardLeft = 1 << 1,
+  ClipGuardRight = 1 << 2,
+  ClipGuardBottom = 1 << 3,
+  ClipGuardTop = 1 << 4,
+  ClipLeft = 1 << 5,
+  ClipRight = 1 << 6,
+  ClipBottom = 1 << 7,
+  ClipTop = 1 << 8,
+} ClipPlane;
 
-  V4 v1_position = v3_to_v4(v1->position, 1.0);
-  v1_position = mat4_mul_v4(mvp, v1_position);
-  v1_position = v4_div(v1_position, v1_position.w);
+// Planes triangles are clipped against.
+#define CLIP_PLANES                                                            \
+  (ClipNear | ClipGuardLeft | ClipGuardRight | ClipGuardBottom | ClipGuardTop)
 
-  V4 v2_position = v3_to_v4(v2->position, 1.0);
-  v2_position = mat4_mul_v4(mvp, v2_position);
-  v2_position = v4_div(v2_position, v2_position.w);
+// Signed distance to the plane, positive inside.
+static inline f32 clip_distance(V4 p, ClipPlane plane, f32 max_depth) {
+  switch (plane) {
+  case ClipNear:
+    return max_depth * p.w - p.z;
+  case ClipGuardLeft:
+    return CLIP_GUARD_BAND * p.w + p.x;
+  case ClipGuardRight:
+    return CLIP_GUARD_BAND * p.w - p.x;
+  case ClipGuardBottom:
+    return CLIP_GUARD_BAND * p.w + p.y;
+  case ClipGuardTop:
+    return CLIP_GUARD_BAND * p.w - p.y;
+  case ClipLeft:
+    return p.w + p.x;
+  case ClipRight:
+    return p.w - p.x;
+  case ClipBottom:
+    return p.w + p.y;
+  case ClipTop:
+    return p.w - p.y;
+  }
+  return 0.0;
+}
+
+// Bit mask of the planes the position is outside of.
+u32 clip_outcode(V4 p, f32 max_depth) {
+  u32 code = 0;
+  for (u32 plane = ClipNear; plane <= ClipTop; plane <<= 1)
+    if (clip_distance(p, plane, max_depth) < 0.0)
+      code |= plane;
+  return code;
+}
 
-  Triangle t = {
-      .v0 = {(v0_position.x + 1.0) / 2.0 * window_width,
-             (v0_position.y + 1.0) / 2.0 * window_hight, v0_position.z},
-      .v0_vertex = v0,
-      .v1 = {(v1_position.x + 1.0) / 2.0 * window_width,
-             (v1_position.y + 1.0) / 2.0 * window_hight, v1_position.z},
-      .v1_vertex = v1,
-      .v2 = {(v2_position.x + 1.0) / 2.0 * window_width,
-             (v2_position.y + 1.0) / 2.0 * window_hight, v2_position.z},
-      .v2_vertex = v2,
+typedef struct {
+  V4 position;
+  Vertex *vertex;
+} ClipVertex;
+
+// Intersection of the edge from the inside vertex `a` to the outside vertex
+// `b`. Edges are always walked from the inside vertex, so triangles sharing
+// the edge get the same intersection.
+ClipVertex clip_intersection(Memory *memory, ClipVertex *a, ClipVertex *b,
+                             f32 da, f32 db) {
+  f32 t = da / (da - db);
+  Vertex *vertex = frame_alloc(memory, Vertex);
+  vertex->position = v3_add(
+      a->vertex->position,
+      v3_mul(v3_sub(b->vertex->position, a->vertex->position), t));
+  vertex->normal =
+      v3_add(a->vertex->normal,
+             v3_mul(v3_sub(b->vertex->normal, a->vertex->normal), t));
+  vertex->uv =
+      v2_add(a->vertex->uv, v2_mul(v2_sub(b->vertex->uv, a->vertex->uv), t));
+  ClipVertex result = {
+      .position = v4_add(a->position,
+                         v4_mul(v4_sub(b->position, a->position), t)),
+      .vertex = vertex,
   };
+  return result;
+}
+
+// Clips the triangle against `planes` and writes the result as a fan of
+// triangles to `out`. Returns the number of written triangles, at most
+// CLIP_MAX_TRIANGLES.
+u32 clip_triangle(Memory *memory, Vertex **vertices, V4 *positions, u32 planes,
+                  f32 max_depth, f32 window_width, f32 window_hight,
+                  Triangle *out) {
+  ClipVertex polygons[2][CLIP_MAX_VERTICES];
+  ClipVertex *polygon = polygons[0];
+  ClipVertex *clipped = polygons[1];
+  u32 vertices_num = 3;
+  for (u32 i = 0; i < 3; i++) {
+    polygon[i].position = positions[i];
+    polygon[i].vertex = vertices[i];
+  }
+
+  for (u32 plane = ClipNear; plane <= ClipGuardTop; plane <<= 1) {
+    if (!(planes & plane))
+      continue;
 
-  return t;
+    u32 clipped_num = 0;
+    for (u32 i = 0; i < vertices_num; i++) {
+      ClipVertex *a = &polygon[i];
+      ClipVertex *b = &polygon[(i + 1) % vertices_num];
+      f32 da = clip_distance(a->position, plane, max_depth);
+      f32 db = clip_distance(b->position, plane, max_depth);
+      if (0.0 <= da)
+        clipped[clipped_num++] = *a;
+      if (0.0 <= da && db < 0.0)
+        clipped[clipped_num++] = clip_intersection(memory, a, b, da, db);
+      else if (da < 0.0 && 0.0 <= db)
+        clipped[clipped_num++] = clip_intersection(memory, b, a, db, da);
+    }
+
+    ClipVertex *tmp = polygon;
+    polygon = clipped;
+    clipped = tmp;
+    vertices_num = clipped_num;
+    if (vertices_num < 3)
+      return 0;
+  }
+
+  V3 v0 = clip_to_screen(polygon[0].position, window_width, window_hight);
+  for (u32 i = 1; i + 1 < vertices_num; i++) {
+    Triangle t = {
+        .v0 = v0,
+        .v0_vertex = polygon[0].vertex,
+        .v1 = clip_to_screen(polygon[i].position, window_width, window_hight),
+        .v1_vertex = polygon[i].vertex,
+        .v2 =
+            clip_to_screen(polygon[i + 1].position, window_width, window_hight),
+        .v2_vertex = polygon[i + 1].vertex,
+    };
+    out[i - 1] = t;
+  }
+  return vertices_num - 2;
 }
 
+// Model space planes of the triangles, `dot(n, p) + d` is positive in front
+// of the triangle. Arrays are padded to FACE_PLANES_BATCH for the SIMD
+// culling.
+#define FACE_PLANES_BATCH 4
+
+typedef struct {
+  f32 *nx;
+  f32 *ny;
+  f32 *nz;
+  f32 *d;
+  u32 faces_num;
+  // Largest `abs(d)`.
+  f32 d_max;
+} FacePlanes;
+
+// Structure of arrays copy of the model positions for the SIMD transform.
+// Arrays are aligned and padded to VERTEX_STREAMS_BATCH, the padding repeats
+// the last vertex. Triangle setup reads the other attributes through the
+// `Vertex` of each corner, so they are not copied.
+#define VERTEX_STREAMS_BATCH 8
+#define VERTEX_STREAMS_ALIGNMENT (VERTEX_STREAMS_BATCH * sizeof(f32))
+
+typedef struct {
+  f32 *x;
+  f32 *y;
+  f32 *z;
+  u32 padded_num;
+} VertexStreams;
+
+// Levels of detail, the vertices are shared by all levels.
+#define MODEL_LODS_MAX 4
+// Triangles of a level relative to the previous one.
+#define LOD_REDUCTION 0.5
+// A level reducing the triangles less than this is not kept.
+#define LOD_MIN_REDUCTION 0.9
+// Largest error, in pixels, of the selected level.
+#define LOD_PIXEL_ERROR 1.0
+
+typedef struct {
+  u32 *indices;
+  u32 indices_num;
+  // Distance the simplified surface can be off by, in model units.
+  f32 error;
+  FacePlanes face_planes;
+} ModelLod;
+
+// Cluster of up to MESHLET_MAX_VERTICES vertices and MESHLET_MAX_TRIANGLES
+// consecutive triangles, culled as a whole by its bounds and normal cone.
+#define MESHLET_MAX_VERTICES 64
+#define MESHLET_MAX_TRIANGLES 124
+
+typedef struct {
+  u32 triangle_offset;
+  u32 triangles_num;
+  u32 vertices_num;
+  Sphere sphere;
+  // Normals of all non degenerate triangles are within the angle with cosine
+  // `cone_cos` and sine `cone_sin` from `cone_axis`. `cone_cos` is 0 when
+  // they do not fit into a cone narrower than a half space.
+  V3 cone_axis;
+  f32 cone_cos;
+  f32 cone_sin;
+} Meshlet;
+
 typedef struct {
   Vertex *vertices;
   u32 vertices_num;
+  // Only filled when loaded with ModelLoadStreams.
+  VertexStreams streams;
   u32 *indices;
   u32 indices_num;
+  // Bounds of the model space positions.
+  AABB3 aabb;
+  Sphere sphere;
+  FacePlanes face_planes;
+  // Only filled when loaded with ModelLoadMeshlets.
+  Meshlet *meshlets;
+  u32 meshlets_num;
+  // Only filled when loaded with ModelLoadLods, level 0 is the model itself.
+  ModelLod lods[MODEL_LODS_MAX];
+  u32 lods_num;
 } Model;
 
+void model_compute_streams(Memory *memory, Model *model) {
+  VertexStreams *streams = &model->streams;
+  streams->padded_num = (model->vertices_num + VERTEX_STREAMS_BATCH - 1) &
+                        ~(VERTEX_STREAMS_BATCH - 1);
+  f32 **arrays[] = {&streams->x, &streams->y, &streams->z};
+  for (u32 i = 0; i < 3; i++)
+    *arrays[i] = perm_alloc_array_aligned(
+        memory, f32, streams->padded_num, VERTEX_STREAMS_ALIGNMENT);
+
+  for (u32 i = 0; i < streams->padded_num; i++) {
+    Vertex *vertex = &model->vertices[MIN(i, model->vertices_num - 1)];
+    streams->x[i] = vertex->position.x;
+    streams->y[i] = vertex->position.y;
+    streams->z[i] = vertex->position.z;
+  }
+}
+
+void model_compute_bounds(Model *model) {
+  AABB3 aabb = {0};
+  if (model->vertices_num)
+    aabb.min = aabb.max = model->vertices[0].position;
+  for (u32 i = 1; i < model->vertices_num; i++) {
+    V3 p = model->vertices[i].position;
+    for (u32 a = 0; a < 3; a++) {
+      aabb.min.v[a] = MIN(aabb.min.v[a], p.v[a]);
+      aabb.max.v[a] = MAX(aabb.max.v[a], p.v[a]);
+    }
+  }
+
+  Sphere sphere = {
+      .center = v3_mul(v3_add(aabb.min, aabb.max), 0.5),
+  };
+  f32 radius_sq = 0.0;
+  for (u32 i = 0; i < model->vertices_num; i++) {
+    V3 d = v3_sub(model->vertices[i].position, sphere.center);
+    radius_sq = MAX(radius_sq, v3_len_sq(d));
+  }
+  sphere.radius = sqrtf(radius_sq);
+
+  model->aabb = aabb;
+  model->sphere = sphere;
+}
+
+static inline u32 face_planes_padded_num(u32 faces_num) {
+  return (faces_num + FACE_PLANES_BATCH - 1) & ~(FACE_PLANES_BATCH - 1);
+}
+
+void model_compute_face_planes(Memory *memory, Model *model) {
+  FacePlanes *planes = &model->face_planes;
+  planes->faces_num = model->indices_num / 3;
+  u32 padded = face_planes_padded_num(planes->faces_num);
+  planes->nx = perm_alloc_array(memory, f32, padded);
+  planes->ny = perm_alloc_array(memory, f32, padded);
+  planes->nz = perm_alloc_array(memory, f32, padded);
+  planes->d = perm_alloc_array(memory, f32, padded);
+  planes->d_max = 0.0;
+
+  for (u32 f = 0; f < padded; f++) {
+    V3 n = {0};
+    f32 d = 0.0;
+    if (f < planes->faces_num) {
+      V3 p0 = model->vertices[model->indices[f * 3]].position;
+      V3 p1 = model->vertices[model->indices[f * 3 + 1]].position;
+      V3 p2 = model->vertices[model->indices[f * 3 + 2]].position;
+      n = v3_cross(v3_sub(p1, p0), v3_sub(p2, p0));
+      f32 len = v3_len(n);
+      if (0.0 < len)
+        n = v3_div(n, len);
+      d = -v3_dot(n, p0);
+    }
+    planes->nx[f] = n.x;
+    planes->ny[f] = n.y;
+    planes->nz[f] = n.z;
+    planes->d[f] = d;
+    planes->d_max = MAX(planes->d_max, fabsf(d));
+  }
+}
+
+// Object space backface culling. A face is culled only if `eye` is behind
+// its plane by more than the rounding error of the test, so it never culls
+// a triangle the screen space test would draw. Degenerate faces have zero
+// normals and are kept.
+#define BACKFACE_EPSILON 1e-4
+
+static inline f32 backface_margin(FacePlanes *planes, V3 eye) {
+  return BACKFACE_EPSILON *
+         (fabsf(eye.x) + fabsf(eye.y) + fabsf(eye.z) + planes->d_max);
+}
+
+// Writes the indices of the faces which are not facing away from `eye`, the
+// model space camera position, to `faces`. Returns their number.
+u32 cull_backfaces(Model *model, V3 eye, u32 *faces) {
+  FacePlanes *planes = &model->face_planes;
+  f32 margin = -backface_margin(planes, eye);
+  u32 faces_num = 0;
+  for (u32 f = 0; f < planes->faces_num; f++) {
+    f32 s = planes->nx[f] * eye.x + planes->ny[f] * eye.y +
+            planes->nz[f] * eye.z + planes->d[f];
+    faces[faces_num] = f;
+    faces_num += !(s < margin);
+  }
+  return faces_num;
+}
+
+// SSE2 is part of the x86_64 baseline, so it needs no runtime check.
+#if defined(__x86_64__)
+#include <immintrin.h>
+
+#define CULL_SIMD
+
+// Same test as `cull_backfaces` for FACE_PLANES_BATCH faces at a time.
+u32 cull_backfaces_sse2(Model *model, V3 eye, u32 *faces) {
+  FacePlanes *planes = &model->face_planes;
+  __m128 margin = _mm_set1_ps(-backface_margin(planes, eye));
+  __m128 ex = _mm_set1_ps(eye.x);
+  __m128 ey = _mm_set1_ps(eye.y);
+  __m128 ez = _mm_set1_ps(eye.z);
+  u32 faces_num = 0;
+  for (u32 f = 0; f < planes->faces_num; f += FACE_PLANES_BATCH) {
+    __m128 s = _mm_mul_ps(_mm_loadu_ps(planes->nx + f), ex);
+    s = _mm_add_ps(s, _mm_mul_ps(_mm_loadu_ps(planes->ny + f), ey));
+    s = _mm_add_ps(s, _mm_mul_ps(_mm_loadu_ps(planes->nz + f), ez));
+    s = _mm_add_ps(s, _mm_loadu_ps(planes->d + f));
+    u32 keep = ~_mm_movemask_ps(_mm_cmplt_ps(s, margin)) & 0xF;
+    if (planes->faces_num < f + FACE_PLANES_BATCH)
+      keep &= (1 << (planes->faces_num - f)) - 1;
+    while (keep) {
+      faces[faces_num++] = f + __builtin_ctz(keep);
+      keep &= keep - 1;
+    }
+  }
+  return faces_num;
+}
+#endif
+
+// Uses the SIMD variant when it is available.
+u32 cull_backfaces_batch(Model *model, V3 eye, u32 *faces) {
+#ifdef CULL_SIMD
+  return cull_backfaces_sse2(model, eye, faces);
+#else
+  return cull_backfaces(model, eye, faces);
+#endif
+}
+
+// Frustum planes as `(normal, distance)` with `dot(normal, p) + distance`
+// not negative inside. Normals are unit length.
+typedef struct {
+  V4 planes[6];
+} Frustum;
+
+// Extracts the planes from the rows of `mvp`. They match the clip planes of
+// `clip_distance`: the sides of the screen, the near plane where depth reaches
+// `max_depth` and the far plane where depth reaches 0.
+Frustum frustum_from_mvp(Mat4 *mvp, f32 max_depth) {
+  V4 x = {mvp->i.x, mvp->j.x, mvp->k.x, mvp->t.x};
+  V4 y = {mvp->i.y, mvp->j.y, mvp->k.y, mvp->t.y};
+  V4 z = {mvp->i.z, mvp->j.z, mvp->k.z, mvp->t.z};
+  V4 w = {mvp->i.w, mvp->j.w, mvp->k.w, mvp->t.w};
+  Frustum frustum = {
+      .planes =
+          {
+              v4_add(w, x),
+              v4_sub(w, x),
+              v4_add(w, y),
+              v4_sub(w, y),
+              v4_sub(v4_mul(w, max_depth), z),
+              z,
+          },
+  };
+  for (u32 i = 0; i < 6; i++) {
+    V4 *plane = &frustum.planes[i];
+    *plane = v4_div(*plane, v3_len(v4_to_v3(*plane)));
+  }
+  return frustum;
+}
+
+bool sphere_in_frustum(Frustum *frustum, Sphere *sphere) {
+  V4 center = v3_to_v4(sphere->center, 1.0);
+  for (u32 i = 0; i < 6; i++)
+    if (v4_dot(frustum->planes[i], center) < -sphere->radius)
+      return false;
+  return true;
+}
+
+bool aabb3_in_frustum(Frustum *frustum, AABB3 *aabb) {
+  for (u32 i = 0; i < 6; i++) {
+    V4 *plane = &frustum->planes[i];
+    // The corner furthest along the plane normal.
+    V4 corner = {
+        .x = 0.0 <= plane->x ? aabb->max.x : aabb->min.x,
+        .y = 0.0 <= plane->y ? aabb->max.y : aabb->min.y,
+        .z = 0.0 <= plane->z ? aabb->max.z : aabb->min.z,
+        .w = 1.0,
+    };
+    if (v4_dot(*plane, corner) < 0.0)
+      return false;
+  }
+  return true;
+}
+
+// Conservative, can return true for some models outside of the frustum.
+// `frustum` has to be extracted from the MVP of the model.
+bool model_in_frustum(Frustum *frustum, Model *model) {
+  return sphere_in_frustum(frustum, &model->sphere) &&
+         aabb3_in_frustum(frustum, &model->aabb);
+}
+
+// Weight of the normal deviation against the number of new vertices when
+// picking the next triangle of a meshlet.
+#define MESHLET_CONE_WEIGHT 2.0
+
+// Grows meshlets greedily over the triangles sharing vertices with them,
+// preferring the ones adding the fewest vertices and keeping the normal cone
+// narrow. Reorders the triangles so every meshlet is a consecutive range.
+// Starts new meshlets in the index order, so run it after the vertex cache
+// optimization.
+void model_compute_meshlets(Memory *memory, Model *model) {
+  ScratchMark scratch = scratch_mark(&memory->frame_memory);
+  u32 triangles_num = model->indices_num / 3;
+  u32 vertices_num = model->vertices_num;
+  u32 *indices = model->indices;
+
+  V3 *normals = frame_alloc_array(memory, V3, triangles_num);
+  for (u32 t = 0; t < triangles_num; t++) {
+    V3 p0 = model->vertices[indices[t * 3]].position;
+    V3 p1 = model->vertices[indices[t * 3 + 1]].position;
+    V3 p2 = model->vertices[indices[t * 3 + 2]].position;
+    V3 n = v3_cross(v3_sub(p1, p0), v3_sub(p2, p0));
+    f32 len = v3_len(n);
+    normals[t] = 0.0 < len ? v3_div(n, len) : n;
+  }
+
+  // Triangles using every vertex.
+  u32 *offsets = frame_alloc_array(memory, u32, vertices_num + 1);
+  memset(offsets, 0, sizeof(u32) * (vertices_num + 1));
+  for (u32 i = 0; i < model->indices_num; i++)
+    offsets[indices[i] + 1]++;
+  for (u32 v = 0; v < vertices_num; v++)
+    offsets[v + 1] += offsets[v];
+  u32 *adjacency = frame_alloc_array(memory, u32, model->indices_num);
+  u32 *adjacency_num = frame_alloc_array(memory, u32, vertices_num);
+  memset(adjacency_num, 0, sizeof(u32) * vertices_num);
+  for (u32 i = 0; i < model->indices_num; i++)
+    adjacency[offsets[indices[i]] + adjacency_num[indices[i]]++] = i / 3;
+
+  // Meshlet which used the vertex last, plus 1.
+  u32 *used = frame_alloc_array(memory, u32, vertices_num);
+  memset(used, 0, sizeof(u32) * vertices_num);
+  bool *emitted = frame_alloc_array(memory, bool, triangles_num);
+  memset(emitted, 0, sizeof(bool) * triangles_num);
+  u32 *order = frame_alloc_array(memory, u32, triangles_num);
+  Meshlet *meshlets = frame_alloc_array(memory, Meshlet, triangles_num);
+  u32 meshlets_num = 0;
+  u32 meshlet_vertices[MESHLET_MAX_VERTICES];
+  u32 scan = 0;
+
+  for (u32 n = 0; n < triangles_num;) {
+    while (emitted[scan])
+      scan++;
+    Meshlet *meshlet = &meshlets[meshlets_num++];
+    *meshlet = (Meshlet){.triangle_offset = n};
+    V3 axis = {0};
+    u32 best = scan;
+
+    while (best != 0xFFFFFFFF) {
+      emitted[best] = true;
+      order[n++] = best;
+      meshlet->triangles_num++;
+      axis = v3_add(axis, normals[best]);
+      for (u32 c = 0; c < 3; c++) {
+        u32 v = indices[best * 3 + c];
+        if (used[v] != meshlets_num) {
+          used[v] = meshlets_num;
+          meshlet_vertices[meshlet->vertices_num++] = v;
+        }
+      }
+      if (meshlet->triangles_num == MESHLET_MAX_TRIANGLES)
+        break;
+
+      f32 len = v3_len(axis);
+      V3 direction = 0.0 < len ? v3_div(axis, len) : axis;
+      f32 best_score = INFINITY;
+      best = 0xFFFFFFFF;
+      for (u32 i = 0; i < meshlet->vertices_num; i++) {
+        u32 v = meshlet_vertices[i];
+        for (u32 j = offsets[v]; j < offsets[v + 1]; j++) {
+          u32 t = adjacency[j];
+          if (emitted[t])
+            continue;
+          u32 new_vertices = 0;
+          for (u32 c = 0; c < 3; c++)
+            new_vertices += used[indices[t * 3 + c]] != meshlets_num;
+          if (MESHLET_MAX_VERTICES < meshlet->vertices_num + new_vertices)
+            continue;
+          f32 score = new_vertices + MESHLET_CONE_WEIGHT *
+                                         (1.0 - v3_dot(normals[t], direction));
+          if (score < best_score) {
+            best_score = score;
+            best = t;
+          }
+        }
+      }
+    }
+  }
+
+  u32 *reordered = frame_alloc_array(memory, u32, model->indices_num);
+  for (u32 t = 0; t < triangles_num; t++)
+    for (u32 c = 0; c < 3; c++)
+      reordered[t * 3 + c] = indices[order[t] * 3 + c];
+  memcpy(indices, reordered, sizeof(u32) * model->indices_num);
+
+  for (u32 m = 0; m < meshlets_num; m++) {
+    Meshlet *meshlet = &meshlets[m];
+    u32 first = meshlet->triangle_offset;
+    u32 last = first + meshlet->triangles_num;
+
+    AABB3 aabb;
+    aabb.min = aabb.max = model->vertices[indices[first * 3]].position;
+    for (u32 i = first * 3; i < last * 3; i++) {
+      V3 p = model->vertices[indices[i]].position;
+      for (u32 a = 0; a < 3; a++) {
+        aabb.min.v[a] = MIN(aabb.min.v[a], p.v[a]);
+        aabb.max.v[a] = MAX(aabb.max.v[a], p.v[a]);
+      }
+    }
+    meshlet->sphere.center = v3_mul(v3_add(aabb.min, aabb.max), 0.5);
+    f32 radius_sq = 0.0;
+    for (u32 i = first * 3; i < last * 3; i++) {
+      V3 d = v3_sub(model->vertices[indices[i]].position,
+                    meshlet->sphere.center);
+      radius_sq = MAX(radius_sq, v3_len_sq(d));
+    }
+    meshlet->sphere.radius = sqrtf(radius_sq);
+
+    V3 axis = {0};
+    for (u32 t = first; t < last; t++)
+      axis = v3_add(axis, normals[order[t]]);
+    f32 len = v3_len(axis);
+    meshlet->cone_cos = 0.0;
+    meshlet->cone_sin = 1.0;
+    if (len == 0.0)
+      continue;
+    axis = v3_div(axis, len);
+    f32 cone_cos = 1.0;
+    for (u32 t = first; t < last; t++)
+      if (v3_len_sq(normals[order[t]]) != 0.0)
+        cone_cos = MIN(cone_cos, v3_dot(normals[order[t]], axis));
+    if (cone_cos <= 0.0)
+      continue;
+    meshlet->cone_axis = axis;
+    meshlet->cone_cos = cone_cos;
+    meshlet->cone_sin = sqrtf(MAX(1.0 - cone_cos * cone_cos, 0.0));
+  }
+
+  model->meshlets = perm_alloc_array(memory, Meshlet, meshlets_num);
+  memcpy(model->meshlets, meshlets, sizeof(Meshlet) * meshlets_num);
+  model->meshlets_num = meshlets_num;
+  scratch_restore(scratch);
+}
+
+// A meshlet is back facing when every point of its bounding sphere is behind
+// the planes of all the normals in its cone, as seen from `eye`. The epsilon
+// keeps the test conservative, like BACKFACE_EPSILON.
+#define MESHLET_CONE_EPSILON 1e-3
+
+bool meshlet_back_facing(Meshlet *meshlet, V3 eye) {
+  if (meshlet->cone_cos == 0.0)
+    return false;
+  V3 to_center = v3_sub(meshlet->sphere.center, eye);
+  f32 distance = v3_len(to_center);
+  if (distance <= meshlet->sphere.radius)
+    return false;
+  // Cosine of the angle between the axis and the view direction, and of that
+  // angle widened by the cone.
+  f32 cos_view = v3_dot(meshlet->cone_axis, to_center) / distance;
+  f32 sin_view = sqrtf(MAX(1.0 - cos_view * cos_view, 0.0));
+  f32 cos_cone = cos_view * meshlet->cone_cos - sin_view * meshlet->cone_sin;
+  return meshlet->sphere.radius / distance + MESHLET_CONE_EPSILON < cos_cone;
+}
+
+// Writes the faces of the meshlets inside of `frustum` to `faces` and returns
+// their number. With `backfaces` back facing meshlets are skipped and faces of
+// the rest are tested like in `cull_backfaces`. `frustum` has to be extracted
+// from the MVP of the model and `eye` is the model space camera position.
+u32 cull_meshlets(Model *model, Frustum *frustum, V3 eye, bool backfaces,
+                  u32 *faces) {
+  FacePlanes *planes = &model->face_planes;
+  f32 margin = -backface_margin(planes, eye);
+  u32 faces_num = 0;
+  for (u32 m = 0; m < model->meshlets_num; m++) {
+    Meshlet *meshlet = &model->meshlets[m];
+    if (!sphere_in_frustum(frustum, &meshlet->sphere))
+      continue;
+    u32 first = meshlet->triangle_offset;
+    u32 last = first + meshlet->triangles_num;
+    if (!backfaces) {
+      for (u32 f = first; f < last; f++)
+        faces[faces_num++] = f;
+      continue;
+    }
+    if (meshlet_back_facing(meshlet, eye))
+      continue;
+    for (u32 f = first; f < last; f++) {
+      f32 s = planes->nx[f] * eye.x + planes->ny[f] * eye.y +
+              planes->nz[f] * eye.z + planes->d[f];
+      faces[faces_num] = f;
+      faces_num += !(s < margin);
+    }
+  }
+  return faces_num;
+}
+
+// Quadric error metric, after Garland and Heckbert, "Surface Simplification
+// Using Quadric Error Metrics". The upper triangle of the symmetric 4x4
+// matrix giving the area weighted sum of the squared distances to a set of
+// planes, and the sum of the weights.
+typedef struct {
+  f64 m[10];
+  f64 weight;
+} Quadric;
+
+Quadric quadric_from_plane(V3 n, f32 d, f32 weight) {
+  Quadric q = {
+      .m = {n.x * n.x, n.x * n.y, n.x * n.z, n.x * d, n.y * n.y, n.y * n.z,
+            n.y * d, n.z * n.z, n.z * d, d * d},
+      .weight = weight,
+  };
+  for (u32 i = 0; i < 10; i++)
+    q.m[i] *= weight;
+  return q;
+}
+
+void quadric_add(Quadric *q, Quadric *other) {
+  for (u32 i = 0; i < 10; i++)
+    q->m[i] += other->m[i];
+  q->weight += other->weight;
+}
+
+// Mean squared distance of `p` to the planes.
+f64 quadric_error(Quadric *q, V3 p) {
+  if (q->weight == 0.0)
+    return 0.0;
+  f64 x = p.x;
+  f64 y = p.y;
+  f64 z = p.z;
+  f64 *m = q->m;
+  f64 e = m[0] * x * x + 2.0 * m[1] * x * y + 2.0 * m[2] * x * z +
+          2.0 * m[3] * x + m[4] * y * y + 2.0 * m[5] * y * z + 2.0 * m[6] * y +
+          m[7] * z * z + 2.0 * m[8] * z + m[9];
+  return MAX(e, 0.0) / q->weight;
+}
+
+typedef struct {
+  f64 cost;
+  u32 from;
+  u32 to;
+} EdgeCollapse;
+
+int edge_collapse_compare(const void *a, const void *b) {
+  const EdgeCollapse *ca = a;
+  const EdgeCollapse *cb = b;
+  if (ca->cost != cb->cost)
+    return ca->cost < cb->cost ? -1 : 1;
+  if (ca->from != cb->from)
+    return ca->from < cb->from ? -1 : 1;
+  return ca->to < cb->to ? -1 : 1;
+}
+
+// Smallest cosine between the normals of a triangle before and after a
+// collapse.
+#define SIMPLIFY_MIN_NORMAL_COS 0.2
+
+// Simplifies the `indices` triangles with edge collapses onto the existing
+// vertices until at most `target_num` indices are left, or no collapse is
+// possible. Vertices on borders and attribute seams are never moved. Writes
+// the triangles to `out` and returns the number of indices. `error` gets the
+// largest root mean square distance of a moved vertex from the planes of its
+// original triangles.
+u32 simplify_triangles(Memory *memory, Model *model, u32 *indices,
+                       u32 indices_num, u32 target_num, u32 *out,
+                       f32 *error) {
+  u32 vertices_num = model->vertices_num;
+  Vertex *vertices = model->vertices;
+  memcpy(out, indices, sizeof(u32) * indices_num);
+  *error = 0.0;
+
+  // Vertices sharing a position get one position id.
+  u32 table_size = 1;
+  while (table_size < vertices_num * 2)
+    table_size <<= 1;
+  u32 *table = frame_alloc_array(memory, u32, table_size);
+  memset(table, 0xFF, sizeof(u32) * table_size);
+  u32 *position_id = frame_alloc_array(memory, u32, vertices_num);
+  u32 *variants = frame_alloc_array(memory, u32, vertices_num);
+  memset(variants, 0, sizeof(u32) * vertices_num);
+  for (u32 v = 0; v < vertices_num; v++) {
+    V3 p = vertices[v].position;
+    u32 bits[3];
+    memcpy(bits, &p, sizeof(bits));
+    u32 slot = (bits[0] * 73856093u ^ bits[1] * 19349663u ^
+                bits[2] * 83492791u) &
+               (table_size - 1);
+    while (table[slot] != 0xFFFFFFFF &&
+           memcmp(&vertices[table[slot]].position, &p, sizeof(V3)))
+      slot = (slot + 1) & (table_size - 1);
+    if (table[slot] == 0xFFFFFFFF)
+      table[slot] = v;
+    position_id[v] = table[slot];
+    variants[position_id[v]]++;
+  }
+
+  bool *locked = frame_alloc_array(memory, bool, vertices_num);
+  for (u32 v = 0; v < vertices_num; v++)
+    locked[v] = 1 < variants[position_id[v]];
+
+  // Edges used by other than 2 triangles are borders or non manifold.
+  u32 edges_size = 1;
+  while (edges_size < indices_num * 2)
+    edges_size <<= 1;
+  u32(*edges)[3] = frame_alloc_array(memory, u32[3], edges_size);
+  memset(edges, 0xFF, sizeof(u32[3]) * edges_size);
+  for (u32 i = 0; i < indices_num; i++) {
+    u32 a = position_id[indices[i]];
+    u32 b = position_id[indices[i - i % 3 + (i + 1) % 3]];
+    u32 lo = MIN(a, b);
+    u32 hi = MAX(a, b);
+    u32 slot = (lo * 73856093u ^ hi * 19349663u) & (edges_size - 1);
+    while (edges[slot][0] != 0xFFFFFFFF &&
+           (edges[slot][0] != lo || edges[slot][1] != hi))
+      slot = (slot + 1) & (edges_size - 1);
+    if (edges[slot][0] == 0xFFFFFFFF) {
+      edges[slot][0] = lo;
+      edges[slot][1] = hi;
+      edges[slot][2] = 0;
+    }
+    edges[slot][2]++;
+  }
+  bool *border = frame_alloc_array(memory, bool, vertices_num);
+  memset(border, 0, sizeof(bool) * vertices_num);
+  for (u32 slot = 0; slot < edges_size; slot++) {
+    if (edges[slot][0] == 0xFFFFFFFF || edges[slot][2] == 2)
+      continue;
+    border[edges[slot][0]] = true;
+    border[edges[slot][1]] = true;
+  }
+  for (u32 v = 0; v < vertices_num; v++)
+    locked[v] |= border[position_id[v]];
+
+  Quadric *quadrics = frame_alloc_array(memory, Quadric, vertices_num);
+  memset(quadrics, 0, sizeof(Quadric) * vertices_num);
+  for (u32 i = 0; i < indices_num; i += 3) {
+    V3 p0 = vertices[indices[i]].position;
+    V3 p1 = vertices[indices[i + 1]].position;
+    V3 p2 = vertices[indices[i + 2]].position;
+    V3 n = v3_cross(v3_sub(p1, p0), v3_sub(p2, p0));
+    f32 len = v3_len(n);
+    if (len == 0.0)
+      continue;
+    n = v3_div(n, len);
+    Quadric q = quadric_from_plane(n, -v3_dot(n, p0), len * 0.5);
+    for (u32 c = 0; c < 3; c++)
+      quadric_add(&quadrics[indices[i + c]], &q);
+  }
+
+  u32 *offsets = frame_alloc_array(memory, u32, vertices_num + 1);
+  u32 *adjacency = frame_alloc_array(memory, u32, indices_num);
+  u32 *fill = frame_alloc_array(memory, u32, vertices_num);
+  u32 *remap = frame_alloc_array(memory, u32, vertices_num);
+  bool *touched = frame_alloc_array(memory, bool, vertices_num);
+  EdgeCollapse *collapses =
+      frame_alloc_array(memory, EdgeCollapse, indices_num * 2);
+
+  while (target_num < indices_num) {
+    // Triangles using every vertex.
+    memset(offsets, 0, sizeof(u32) * (vertices_num + 1));
+    for (u32 i = 0; i < indices_num; i++)
+      offsets[out[i] + 1]++;
+    for (u32 v = 0; v < vertices_num; v++)
+      offsets[v + 1] += offsets[v];
+    memcpy(fill, offsets, sizeof(u32) * vertices_num);
+    for (u32 i = 0; i < indices_num; i++)
+      adjacency[fill[out[i]]++] = i / 3;
+
+    u32 collapses_num = 0;
+    for (u32 i = 0; i < indices_num; i++) {
+      u32 a = out[i];
+      u32 b = out[i - i % 3 + (i + 1) % 3];
+      for (u32 k = 0; k < 2; k++) {
+        u32 from = k ? b : a;
+        u32 to = k ? a : b;
+        if (locked[from])
+          continue;
+        Quadric q = quadrics[from];
+        quadric_add(&q, &quadrics[to]);
+        collapses[collapses_num++] = (EdgeCollapse){
+            .cost = quadric_error(&q, vertices[to].position),
+            .from = from,
+            .to = to,
+        };
+      }
+    }
+    qsort(collapses, collapses_num, sizeof(EdgeCollapse),
+          edge_collapse_compare);
+
+    // Collapses of one pass do not share triangles, so the adjacency stays
+    // valid for the checks.
+    for (u32 v = 0; v < vertices_num; v++) {
+      remap[v] = v;
+      touched[v] = false;
+    }
+    u32 removed_num = 0;
+    for (u32 c = 0; c < collapses_num; c++) {
+      if (indices_num - removed_num <= target_num)
+        break;
+      u32 from = collapses[c].from;
+      u32 to = collapses[c].to;
+      if (touched[from] || touched[to])
+        continue;
+
+      // Link condition, the edge has exactly 2 common neighbors.
+      u32 common = 0;
+      for (u32 j = offsets[from]; j < offsets[from + 1]; j++) {
+        u32 *t = &out[adjacency[j] * 3];
+        for (u32 e = 0; e < 3; e++) {
+          u32 n = position_id[t[e]];
+          if (n == position_id[from] || n == position_id[to])
+            continue;
+          bool shared = false;
+          for (u32 l = offsets[to]; l < offsets[to + 1] && !shared; l++)
+            for (u32 f = 0; f < 3; f++)
+              shared |= position_id[out[adjacency[l] * 3 + f]] == n;
+          common += shared;
+        }
+      }
+      // Every common neighbor is seen from 2 triangles around `from`.
+      if (common != 4)
+        continue;
+
+      bool flipped = false;
+      u32 degenerate = 0;
+      for (u32 j = offsets[from]; j < offsets[from + 1]; j++) {
+        u32 *t = &out[adjacency[j] * 3];
+        if (t[0] == to || t[1] == to || t[2] == to) {
+          degenerate++;
+          continue;
+        }
+        V3 p[3];
+        V3 q[3];
+        for (u32 e = 0; e < 3; e++) {
+          p[e] = vertices[t[e]].position;
+          q[e] = t[e] == from ? vertices[to].position : p[e];
+        }
+        V3 n0 = v3_cross(v3_sub(p[1], p[0]), v3_sub(p[2], p[0]));
+        V3 n1 = v3_cross(v3_sub(q[1], q[0]), v3_sub(q[2], q[0]));
+        f32 len = v3_len(n0) * v3_len(n1);
+        flipped |= !(SIMPLIFY_MIN_NORMAL_COS * len < v3_dot(n0, n1));
+      }
+      if (flipped)
+        continue;
+
+      for (u32 j = offsets[from]; j < offsets[from + 1]; j++)
+        for (u32 e = 0; e < 3; e++)
+          touched[out[adjacency[j] * 3 + e]] = true;
+      remap[from] = to;
+      quadric_add(&quadrics[to], &quadrics[from]);
+      *error = MAX(*error, sqrtf(collapses[c].cost));
+      removed_num += degenerate * 3;
+    }
+    if (!removed_num)
+      break;
+
+    u32 kept_num = 0;
+    for (u32 i = 0; i < indices_num; i += 3) {
+      u32 a = remap[out[i]];
+      u32 b = remap[out[i + 1]];
+      u32 c = remap[out[i + 2]];
+      if (a == b || b == c || c == a)
+        continue;
+      out[kept_num++] = a;
+      out[kept_num++] = b;
+      out[kept_num++] = c;
+    }
+    indices_num = kept_num;
+  }
+  return indices_num;
+}
+
+// Builds the LOD chain, every level has about LOD_REDUCTION of the triangles
+// of the previous one. Stops early when a level can not be simplified much.
+void model_compute_lods(Memory *memory, Model *model) {
+  ModelLod *lod = &model->lods[0];
+  lod->indices = model->indices;
+  lod->indices_num = model->indices_num;
+  lod->error = 0.0;
+  lod->face_planes = model->face_planes;
+  model->lods_num = 1;
+
+  while (model->lods_num < MODEL_LODS_MAX) {
+    ModelLod *prev = &model->lods[model->lods_num - 1];
+    u32 target_num = (u32)(prev->indices_num / 3 * LOD_REDUCTION) * 3;
+    // Every level is built in the same frame memory.
+    ScratchMark scratch = scratch_mark(&memory->frame_memory);
+    u32 *indices = frame_alloc_array(memory, u32, prev->indices_num);
+    f32 error;
+    u32 indices_num =
+        simplify_triangles(memory, model, prev->indices, prev->indices_num,
+                           target_num, indices, &error);
+    if (prev->indices_num * LOD_MIN_REDUCTION < indices_num) {
+      scratch_restore(scratch);
+      break;
+    }
+
+    ModelLod *lod = &model->lods[model->lods_num++];
+    lod->indices = perm_alloc_array(memory, u32, indices_num);
+    memcpy(lod->indices, indices, sizeof(u32) * indices_num);
+    lod->indices_num = indices_num;
+    // Errors of the levels add up, as every level is built from the
+    // previous one.
+    lod->error = prev->error + error;
+    Model level = *model;
+    level.indices = lod->indices;
+    level.indices_num = indices_num;
+    model_compute_face_planes(memory, &level);
+    lod->face_planes = level.face_planes;
+    scratch_restore(scratch);
+  }
+}
+
+// Picks the coarsest level with the error projected to the screen under
+// LOD_PIXEL_ERROR, measured at the point of the bounding sphere closest to the
+// camera.
+u32 model_select_lod(Model *model, Mat4 *mvp, f32 window_width,
+                     f32 window_hight) {
+  if (model->lods_num < 2)
+    return 0;
+  V4 center = mat4_mul_v4(mvp, v3_to_v4(model->sphere.center, 1.0));
+  V3 row_x = {mvp->i.x, mvp->j.x, mvp->k.x};
+  V3 row_y = {mvp->i.y, mvp->j.y, mvp->k.y};
+  V3 row_w = {mvp->i.w, mvp->j.w, mvp->k.w};
+  f32 w = center.w - model->sphere.radius * v3_len(row_w);
+  if (w <= 0.0)
+    return 0;
+  // Pixels per model space unit.
+  f32 scale = MAX(v3_len(row_x) * window_width, v3_len(row_y) * window_hight) *
+              0.5 / w;
+  u32 level = model->lods_num - 1;
+  while (level && LOD_PIXEL_ERROR < model->lods[level].error * scale)
+    level--;
+  return level;
+}
+
+// View of the model with the triangles of the LOD `level`.
+Model model_lod(Model *model, u32 level) {
+  Model result = *model;
+  if (!level)
+    return result;
+  result.indices = model->lods[level].indices;
+  result.indices_num = model->lods[level].indices_num;
+  result.face_planes = model->lods[level].face_planes;
+  // Meshlets are built for the full detail triangles only.
+  result.meshlets = NULL;
+  result.meshlets_num = 0;
+  return result;
+}
+
+// Load time reordering of the index buffer, after Forsyth, "Linear-Speed
+// Vertex Cache Optimisation". Vertices used by the last triangles and vertices
+// with few triangles left score higher, so triangles are emitted around the
+// vertices which are still in the cache.
+#define VERTEX_CACHE_SIZE 32
+#define VERTEX_CACHE_DECAY_POWER 1.5
+#define VERTEX_CACHE_LAST_TRIANGLE_SCORE 0.75
+#define VERTEX_VALENCE_BOOST_SCALE 2.0
+#define VERTEX_VALENCE_BOOST_POWER 0.5
+// FIFO cache used to measure the ACMR and to find the cluster boundaries.
+#define VERTEX_CACHE_FIFO_SIZE 16
+// Smallest cluster the overdraw pass splits off.
+#define OVERDRAW_CLUSTER_MIN 16
+// Resolution of the views the expected overdraw is measured with.
+#define OVERDRAW_RESOLUTION 64
+
+f32 vertex_cache_score(i32 cache_position, u32 triangles_left) {
+  if (!triangles_left)
+    return -1.0;
+  f32 score = 0.0;
+  if (0 <= cache_position && cache_position < 3) {
+    score = VERTEX_CACHE_LAST_TRIANGLE_SCORE;
+  } else if (0 <= cache_position) {
+    f32 s = 1.0 - (f32)(cache_position - 3) / (VERTEX_CACHE_SIZE - 3);
+    score = powf(s, VERTEX_CACHE_DECAY_POWER);
+  }
+  return score + VERTEX_VALENCE_BOOST_SCALE *
+                     powf((f32)triangles_left, -VERTEX_VALENCE_BOOST_POWER);
+}
+
+// Reorders the triangles of `indices` for the post-transform vertex cache.
+void optimize_vertex_cache(Memory *memory, u32 *indices, u32 indices_num,
+                           u32 vertices_num) {
+  u32 triangles_num = indices_num / 3;
+  if (!triangles_num)
+    return;
+  ScratchMark scratch = scratch_mark(&memory->frame_memory);
+
+  // Triangles not emitted yet, per vertex.
+  u32 *triangles_left = frame_alloc_array(memory, u32, vertices_num);
+  u32 *offsets = frame_alloc_array(memory, u32, vertices_num + 1);
+  memset(triangles_left, 0, sizeof(u32) * vertices_num);
+  for (u32 i = 0; i < indices_num; i++)
+    triangles_left[indices[i]]++;
+  offsets[0] = 0;
+  for (u32 v = 0; v < vertices_num; v++)
+    offsets[v + 1] = offsets[v] + triangles_left[v];
+
+  u32 *adjacency = frame_alloc_array(memory, u32, indices_num);
+  u32 *adjacency_num = frame_alloc_array(memory, u32, vertices_num);
+  memset(adjacency_num, 0, sizeof(u32) * vertices_num);
+  for (u32 i = 0; i < indices_num; i++) {
+    u32 v = indices[i];
+    adjacency[offsets[v] + adjacency_num[v]++] = i / 3;
+  }
+
+  i32 *cache_position = frame_alloc_array(memory, i32, vertices_num);
+  f32 *vertex_score = frame_alloc_array(memory, f32, vertices_num);
+  for (u32 v = 0; v < vertices_num; v++) {
+    cache_position[v] = -1;
+    vertex_score[v] = vertex_cache_score(-1, triangles_left[v]);
+  }
+
+  f32 *triangle_score = frame_alloc_array(memory, f32, triangles_num);
+  bool *emitted = frame_alloc_array(memory, bool, triangles_num);
+  for (u32 t = 0; t < triangles_num; t++) {
+    triangle_score[t] = vertex_score[indices[t * 3]] +
+                        vertex_score[indices[t * 3 + 1]] +
+                        vertex_score[indices[t * 3 + 2]];
+    emitted[t] = false;
+  }
+
+  u32 *result = frame_alloc_array(memory, u32, indices_num);
+  u32 cache[VERTEX_CACHE_SIZE + 3];
+  u32 cache_num = 0;
+  u32 best = 0;
+  u32 scan = 0;
+  for (u32 n = 0; n < triangles_num; n++) {
+    // No cached vertex has triangles left, take the next unused triangle.
+    if (best == 0xFFFFFFFF) {
+      while (emitted[scan])
+        scan++;
+      best = scan;
+    }
+
+    emitted[best] = true;
+    u32 *triangle = &indices[best * 3];
+    for (u32 c = 0; c < 3; c++) {
+      u32 v = triangle[c];
+      result[n * 3 + c] = v;
+      u32 *list = &adjacency[offsets[v]];
+      for (u32 i = 0; i < triangles_left[v]; i++) {
+        if (list[i] == best) {
+          list[i] = list[triangles_left[v] - 1];
+          break;
+        }
+      }
+      triangles_left[v]--;
+    }
+
+    u32 new_cache[VERTEX_CACHE_SIZE + 3];
+    u32 new_cache_num = 0;
+    for (u32 c = 0; c < 3; c++)
+      new_cache[new_cache_num++] = triangle[c];
+    for (u32 i = 0; i < cache_num; i++)
+      if (cache[i] != triangle[0] && cache[i] != triangle[1] &&
+          cache[i] != triangle[2])
+        new_cache[new_cache_num++] = cache[i];
+
+    // Vertices pushed past the cache size are evicted.
+    for (u32 i = 0; i < new_cache_num; i++) {
+      u32 v = new_cache[i];
+      cache_position[v] = i < VERTEX_CACHE_SIZE ? (i32)i : -1;
+      f32 score = vertex_cache_score(cache_position[v], triangles_left[v]);
+      f32 delta = score - vertex_score[v];
+      vertex_score[v] = score;
+      for (u32 j = 0; j < triangles_left[v]; j++)
+        triangle_score[adjacency[offsets[v] + j]] += delta;
+    }
+    cache_num = MIN(new_cache_num, VERTEX_CACHE_SIZE);
+    memcpy(cache, new_cache, sizeof(u32) * cache_num);
+
+    best = 0xFFFFFFFF;
+    f32 best_score = -1.0;
+    for (u32 i = 0; i < cache_num; i++) {
+      u32 v = cache[i];
+      for (u32 j = 0; j < triangles_left[v]; j++) {
+        u32 t = adjacency[offsets[v] + j];
+        if (best_score < triangle_score[t]) {
+          best_score = triangle_score[t];
+          best = t;
+        }
+      }
+    }
+  }
+
+  memcpy(indices, result, sizeof(u32) * indices_num);
+  scratch_restore(scratch);
+}
+
+// Average cache miss ratio, transformed vertices per triangle, of a FIFO
+// vertex cache.
+f32 vertex_cache_acmr(Memory *memory, u32 *indices, u32 indices_num,
+                      u32 vertices_num) {
+  ScratchMark scratch = scratch_mark(&memory->frame_memory);
+  // Number of misses when the vertex was last inserted, plus 1.
+  u32 *inserted = frame_alloc_array(memory, u32, vertices_num);
+  memset(inserted, 0, sizeof(u32) * vertices_num);
+  u32 misses = 0;
+  for (u32 i = 0; i < indices_num; i++) {
+    u32 v = indices[i];
+    if (inserted[v] && misses - (inserted[v] - 1) < VERTEX_CACHE_FIFO_SIZE)
+      continue;
+    inserted[v] = ++misses;
+  }
+  scratch_restore(scratch);
+  return indices_num ? (f32)misses / (f32)(indices_num / 3) : 0.0;
+}
+
+typedef struct {
+  u32 start;
+  u32 triangles_num;
+  f32 sort_key;
+} TriangleCluster;
+
+int triangle_cluster_compare(const void *a, const void *b) {
+  const TriangleCluster *ca = a;
+  const TriangleCluster *cb = b;
+  if (ca->sort_key != cb->sort_key)
+    return ca->sort_key < cb->sort_key ? 1 : -1;
+  return ca->start < cb->start ? -1 : 1;
+}
+
+// Reorders clusters of triangles to draw the ones likely to occlude the rest
+// first, after Sander et al., "Fast Triangle Reordering for Vertex Locality
+// and Reduced Overdraw". Clusters are split where the FIFO cache misses at
+// least 2 of the 3 vertices, so the vertex cache order is mostly kept. A
+// cluster far from the model center along its average normal faces outwards
+// and is drawn first.
+void optimize_overdraw(Memory *memory, Vertex *vertices, u32 vertices_num,
+                       u32 *indices, u32 indices_num) {
+  u32 triangles_num = indices_num / 3;
+  if (!triangles_num)
+    return;
+  ScratchMark scratch = scratch_mark(&memory->frame_memory);
+
+  TriangleCluster *clusters =
+      frame_alloc_array(memory, TriangleCluster, triangles_num);
+  u32 clusters_num = 0;
+  u32 *inserted = frame_alloc_array(memory, u32, vertices_num);
+  memset(inserted, 0, sizeof(u32) * vertices_num);
+  u32 misses = 0;
+  for (u32 t = 0; t < triangles_num; t++) {
+    u32 triangle_misses = 0;
+    for (u32 c = 0; c < 3; c++) {
+      u32 v = indices[t * 3 + c];
+      if (inserted[v] && misses - (inserted[v] - 1) < VERTEX_CACHE_FIFO_SIZE)
+        continue;
+      inserted[v] = ++misses;
+      triangle_misses++;
+    }
+    if (!clusters_num || (2 <= triangle_misses &&
+                          OVERDRAW_CLUSTER_MIN <=
+                              clusters[clusters_num - 1].triangles_num)) {
+      clusters[clusters_num].start = t;
+      clusters[clusters_num].triangles_num = 0;
+      clusters_num++;
+    }
+    clusters[clusters_num - 1].triangles_num++;
+  }
+
+  // Area weighted centers and normals.
+  V3 *centers = frame_alloc_array(memory, V3, clusters_num);
+  V3 *normals = frame_alloc_array(memory, V3, clusters_num);
+  V3 model_center = {0};
+  f32 model_area = 0.0;
+  for (u32 i = 0; i < clusters_num; i++) {
+    TriangleCluster *cluster = &clusters[i];
+    V3 center = {0};
+    V3 normal = {0};
+    f32 area = 0.0;
+    for (u32 t = cluster->start; t < cluster->start + cluster->triangles_num;
+         t++) {
+      V3 p0 = vertices[indices[t * 3]].position;
+      V3 p1 = vertices[indices[t * 3 + 1]].position;
+      V3 p2 = vertices[indices[t * 3 + 2]].position;
+      V3 n = v3_cross(v3_sub(p1, p0), v3_sub(p2, p0));
+      f32 a = v3_len(n);
+      V3 c = v3_div(v3_add(v3_add(p0, p1), p2), 3.0);
+      center = v3_add(center, v3_mul(c, a));
+      normal = v3_add(normal, n);
+      area += a;
+    }
+    model_center = v3_add(model_center, center);
+    model_area += area;
+    centers[i] = 0.0 < area ? v3_div(center, area) : center;
+    f32 len = v3_len(normal);
+    normals[i] = 0.0 < len ? v3_div(normal, len) : normal;
+  }
+  if (0.0 < model_area)
+    model_center = v3_div(model_center, model_area);
+
+  for (u32 i = 0; i < clusters_num; i++)
+    clusters[i].sort_key =
+        v3_dot(v3_sub(centers[i], model_center), normals[i]);
+  qsort(clusters, clusters_num, sizeof(TriangleCluster),
+        triangle_cluster_compare);
+
+  u32 *result = frame_alloc_array(memory, u32, indices_num);
+  u32 result_num = 0;
+  for (u32 i = 0; i < clusters_num; i++) {
+    u32 num = clusters[i].triangles_num * 3;
+    memcpy(&result[result_num], &indices[clusters[i].start * 3],
+           sizeof(u32) * num);
+    result_num += num;
+  }
+  memcpy(indices, result, sizeof(u32) * indices_num);
+  scratch_restore(scratch);
+}
+
+// Reorders the vertices by their first use, so vertices used together are
+// close in memory.
+void optimize_vertex_fetch(Memory *memory, Vertex *vertices, u32 vertices_num,
+                           u32 *indices, u32 indices_num) {
+  ScratchMark scratch = scratch_mark(&memory->frame_memory);
+  u32 *remap = frame_alloc_array(memory, u32, vertices_num);
+  memset(remap, 0xFF, sizeof(u32) * vertices_num);
+  Vertex *result = frame_alloc_array(memory, Vertex, vertices_num);
+  u32 result_num = 0;
+  for (u32 i = 0; i < indices_num; i++) {
+    u32 v = indices[i];
+    if (remap[v] == 0xFFFFFFFF) {
+      remap[v] = result_num;
+      result[result_num++] = vertices[v];
+    }
+    indices[i] = remap[v];
+  }
+  // Vertices not used by any triangle go last.
+  for (u32 v = 0; v < vertices_num; v++)
+    if (remap[v] == 0xFFFFFFFF)
+      result[result_num++] = vertices[v];
+  memcpy(vertices, result, sizeof(Vertex) * vertices_num);
+  scratch_restore(scratch);
+}
+
+// Expected overdraw, shaded fragments per covered pixel, with the depth test
+// and backface culling. Averaged over orthographic views along the 6 axes.
+f32 model_overdraw(Memory *memory, Vertex *vertices, u32 *indices,
+                   u32 indices_num, Sphere *sphere) {
+  const u32 size = OVERDRAW_RESOLUTION;
+  ScratchMark scratch = scratch_mark(&memory->frame_memory);
+  f32 *depth = frame_alloc_array(memory, f32, size * size);
+  V3 directions[6] = {{1.0, 0.0, 0.0},  {-1.0, 0.0, 0.0}, {0.0, 1.0, 0.0},
+                      {0.0, -1.0, 0.0}, {0.0, 0.0, 1.0},  {0.0, 0.0, -1.0}};
+  f32 scale = 0.0 < sphere->radius ? 0.5 * size / sphere->radius : 0.0;
+  u64 shaded = 0;
+  u64 covered = 0;
+
+  for (u32 d = 0; d < 6; d++) {
+    V3 dir = directions[d];
+    V3 axis = fabsf(dir.x) < 0.5 ? (V3){1.0, 0.0, 0.0}
+                                  : (V3){0.0, 1.0, 0.0};
+    V3 u = v3_cross(dir, axis);
+    u = v3_div(u, v3_len(u));
+    V3 v = v3_cross(dir, u);
+    for (u32 i = 0; i < size * size; i++)
+      depth[i] = -INFINITY;
+
+    for (u32 t = 0; t < indices_num; t += 3) {
+      V3 p[3];
+      for (u32 c = 0; c < 3; c++)
+        p[c] = vertices[indices[t + c]].position;
+      // Faces looking along the view direction are back faces.
+      V3 n = v3_cross(v3_sub(p[1], p[0]), v3_sub(p[2], p[0]));
+      if (0.0 <= v3_dot(n, dir))
+        continue;
+
+      V3 s[3];
+      for (u32 c = 0; c < 3; c++) {
+        V3 r = v3_sub(p[c], sphere->center);
+        s[c] = (V3){v3_dot(r, u) * scale + 0.5 * size,
+                    v3_dot(r, v) * scale + 0.5 * size, -v3_dot(r, dir)};
+      }
+      f32 area = (s[1].x - s[0].x) * (s[2].y - s[0].y) -
+                 (s[2].x - s[0].x) * (s[1].y - s[0].y);
+      if (area == 0.0)
+        continue;
+
+      f32 min_x = MAX(MIN(MIN(s[0].x, s[1].x), s[2].x), 0.0);
+      f32 min_y = MAX(MIN(MIN(s[0].y, s[1].y), s[2].y), 0.0);
+      f32 max_x = MIN(MAX(MAX(s[0].x, s[1].x), s[2].x), size);
+      f32 max_y = MIN(MAX(MAX(s[0].y, s[1].y), s[2].y), size);
+      for (u32 y = (u32)min_y; y < (u32)ceilf(max_y); y++) {
+        for (u32 x = (u32)min_x; x < (u32)ceilf(max_x); x++) {
+          f32 px = x + 0.5;
+          f32 py = y + 0.5;
+          f32 w0 = ((s[2].x - s[1].x) * (py - s[1].y) -
+                    (s[2].y - s[1].y) * (px - s[1].x)) /
+                   area;
+          f32 w1 = ((s[0].x - s[2].x) * (py - s[2].y) -
+                    (s[0].y - s[2].y) * (px - s[2].x)) /
+                   area;
+          f32 w2 = 1.0 - w0 - w1;
+          if (w0 < 0.0 || w1 < 0.0 || w2 < 0.0)
+            continue;
+          f32 z = w0 * s[0].z + w1 * s[1].z + w2 * s[2].z;
+          f32 *d = &depth[y * size + x];
+          if (*d < z) {
+            *d = z;
+            shaded++;
+          }
+        }
+      }
+    }
+
+    for (u32 i = 0; i < size * size; i++)
+      covered += depth[i] != -INFINITY;
+  }
+  scratch_restore(scratch);
+  return covered ? (f32)shaded / (f32)covered : 0.0;
+}
+
 typedef struct {
   u32 position_index;
   u32 uv_index;
   u32 normal_index;
 } ModelFace;
 
-Model load_model(Memory *memory, const char *obj_path) {
-  i32 fd = open(obj_path, O_RDONLY);
-  ASSERT((0 < fd), "Failed to open font file 2: %s", obj_path);
+typedef enum {
+  // Reorder the triangles for the vertex cache and the overdraw and the
+  // vertices for the fetch locality.
+  ModelLoadOptimize = 1 << 0,
+  // Fill `Model.streams`.
+  ModelLoadStreams = 1 << 1,
+  // Fill `Model.meshlets`.
+  ModelLoadMeshlets = 1 << 2,
+  // Fill `Model.lods`.
+  ModelLoadLods = 1 << 3,
+} ModelLoadFlags;
 
-  struct stat sb;
-  ASSERT((fstat(fd, &sb) != -1), "Failed to get a font file %s size", obj_path);
+// Flags of the models used by the game and stored in the mesh files.
+#define MODEL_LOAD_DEFAULT                                                     \
+  (ModelLoadOptimize | ModelLoadStreams | ModelLoadMeshlets | ModelLoadLods)
+
+// OBJ files are parsed in line aligned chunks on the thread pool. The first
+// pass counts the elements of every chunk, the second one writes them after
+// the elements of all the chunks before it. Writes stop at the counts of the
+// first pass, in case the file changed in between.
+#define OBJ_CHUNK_SIZE (256 * 1024)
+
+typedef struct {
+  const char *start;
+  const char *end;
+  u32 positions_num;
+  u32 uvs_num;
+  u32 normals_num;
+  u32 corners_num;
+  u32 missing_normals_num;
+  // A face uses an element that is not defined before it.
+  bool bad_index;
+  u32 positions_offset;
+  u32 uvs_offset;
+  u32 normals_offset;
+  u32 corners_offset;
+} ObjChunk;
+
+typedef struct {
+  ObjChunk *chunks;
+  V3 *positions;
+  V2 *uvs;
+  V3 *normals;
+  ModelFace *corners;
+  bool write;
+} ObjParse;
+
+bool obj_space(char c) { return c == ' ' || c == '\t' || c == '\r'; }
+bool obj_digit(char c) { return '0' <= c && c <= '9'; }
 
-  u8 *file_mem = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
-  ASSERT(file_mem, "Failed to mmap font file: %s", obj_path);
+// Decimal float with an optional fraction and exponent. Up to 19 significant
+// digits are exact in the mantissa and powers up to 1e22 are exact doubles,
+// so the common case is one rounding in f64 and one to f32.
+f32 parse_f32(const char **cursor, const char *end) {
+  static const f64 powers[] = {1e0,  1e1,  1e2,  1e3,  1e4,  1e5,
+                               1e6,  1e7,  1e8,  1e9,  1e10, 1e11,
+                               1e12, 1e13, 1e14, 1e15, 1e16, 1e17,
+                               1e18, 1e19, 1e20, 1e21, 1e22};
+  const char *c = *cursor;
+  while (c < end && obj_space(*c))
+    c++;
 
-#define SKIP_BEYOND(line, x)                                                   \
-  while (*line != x) {                                                         \
-    line++;                                                                    \
-  }                                                                            \
-  line++;
+  bool negative = false;
+  if (c < end && (*c == '-' || *c == '+'))
+    negative = *c++ == '-';
 
-  const char *line = (const char *)file_mem;
-  char *end;
+  u64 mantissa = 0;
+  i32 exponent = 0;
+  u32 digits = 0;
+  for (; c < end && obj_digit(*c); c++) {
+    if (digits < 19) {
+      mantissa = mantissa * 10 + (u64)(*c - '0');
+      digits += mantissa != 0;
+    } else {
+      exponent++;
+    }
+  }
+  if (c < end && *c == '.') {
+    for (c++; c < end && obj_digit(*c); c++) {
+      if (digits < 19) {
+        mantissa = mantissa * 10 + (u64)(*c - '0');
+        digits += mantissa != 0;
+        exponent--;
+      }
+    }
+  }
+  if (c < end && (*c == 'e' || *c == 'E')) {
+    c++;
+    bool negative_exponent = false;
+    if (c < end && (*c == '-' || *c == '+'))
+      negative_exponent = *c++ == '-';
+    i32 e = 0;
+    for (; c < end && obj_digit(*c); c++)
+      e = MIN(e * 10 + (*c - '0'), 100000);
+    exponent += negative_exponent ? -e : e;
+  }
+  *cursor = c;
+
+  f64 value = (f64)mantissa;
+  if (exponent < 0)
+    value /= -exponent < 23 ? powers[-exponent] : pow(10.0, -exponent);
+  else if (0 < exponent)
+    value *= exponent < 23 ? powers[exponent] : pow(10.0, exponent);
+  return (f32)(negative ? -value : value);
+}
+
+i32 parse_i32(const char **cursor, const char *end) {
+  const char *c = *cursor;
+  bool negative = false;
+  if (c < end && (*c == '-' || *c == '+'))
+    negative = *c++ == '-';
+  i64 value = 0;
+  for (; c < end && obj_digit(*c); c++)
+    value = MIN(value * 10 + (*c - '0'), INT32_MAX);
+  *cursor = c;
+  return negative ? -(i32)value : (i32)value;
+}
+
+// Index of an element outside of the ones defined so far.
+#define OBJ_BAD_INDEX 0xFFFFFFFF
+
+// Turns a 1 based or a negative, relative to the end, OBJ index into a 1
+// based one among the `count` elements defined so far. 0 marks a missing
+// component.
+u32 obj_index(i32 index, u32 count) {
+  if (index < 0)
+    return (u32)-index <= count ? count + index + 1 : OBJ_BAD_INDEX;
+  return (u32)index <= count ? (u32)index : OBJ_BAD_INDEX;
+}
 
+void obj_parse_chunk(void *data, u32 index) {
+  ObjParse *parse = data;
+  ObjChunk *chunk = &parse->chunks[index];
   u32 positions_num = 0;
-  u32 normals_num = 0;
   u32 uvs_num = 0;
-  u32 faces_num = 0;
+  u32 normals_num = 0;
+  u32 corners_num = 0;
+  u32 missing_normals_num = 0;
+  bool bad_index = false;
 
-  while (*line) {
-    switch (*line) {
-    case 'v':
-      line++;
-      switch (*line) {
-      case ' ':
-        positions_num++;
-        SKIP_BEYOND(line, '\n')
-        break;
-      case 'n':
-        normals_num++;
-        SKIP_BEYOND(line, '\n')
-        break;
-      case 't':
-        uvs_num++;
-        SKIP_BEYOND(line, '\n')
-        break;
-      default:
-        SKIP_BEYOND(line, '\n')
-        break;
+  const char *c = chunk->start;
+  while (c < chunk->end) {
+    const char *line_end = memchr(c, '\n', chunk->end - c);
+    if (!line_end)
+      line_end = chunk->end;
+    while (c < line_end && obj_space(*c))
+      c++;
+
+    if (2 < line_end - c && c[0] == 'v' && obj_space(c[1])) {
+      c += 2;
+      if (parse->write && positions_num < chunk->positions_num) {
+        V3 *p = &parse->positions[chunk->positions_offset + positions_num];
+        p->x = parse_f32(&c, line_end);
+        p->y = parse_f32(&c, line_end);
+        p->z = parse_f32(&c, line_end);
+      }
+      positions_num++;
+    } else if (3 < line_end - c && c[0] == 'v' && c[1] == 't' &&
+               obj_space(c[2])) {
+      c += 3;
+      if (parse->write && uvs_num < chunk->uvs_num) {
+        V2 *uv = &parse->uvs[chunk->uvs_offset + uvs_num];
+        uv->x = parse_f32(&c, line_end);
+        uv->y = parse_f32(&c, line_end);
+      }
+      uvs_num++;
+    } else if (3 < line_end - c && c[0] == 'v' && c[1] == 'n' &&
+               obj_space(c[2])) {
+      c += 3;
+      if (parse->write && normals_num < chunk->normals_num) {
+        V3 *n = &parse->normals[chunk->normals_offset + normals_num];
+        n->x = parse_f32(&c, line_end);
+        n->y = parse_f32(&c, line_end);
+        n->z = parse_f32(&c, line_end);
+      }
+      normals_num++;
+    } else if (2 < line_end - c && c[0] == 'f' && obj_space(c[1])) {
+      // Corners are p, p/t, p//n or p/t/n. Polygons become a triangle fan
+      // around the first corner.
+      c += 2;
+      u32 n = 0;
+      ModelFace first = {0};
+      ModelFace prev = {0};
+      while (true) {
+        while (c < line_end && obj_space(*c))
+          c++;
+        if (line_end <= c)
+          break;
+        i32 p = parse_i32(&c, line_end);
+        i32 t = 0;
+        i32 nn = 0;
+        if (c < line_end && *c == '/') {
+          c++;
+          t = parse_i32(&c, line_end);
+          if (c < line_end && *c == '/') {
+            c++;
+            nn = parse_i32(&c, line_end);
+          }
+        }
+        while (c < line_end && !obj_space(*c))
+          c++;
+
+        ModelFace corner = {
+            .position_index =
+                obj_index(p, chunk->positions_offset + positions_num),
+            .uv_index = obj_index(t, chunk->uvs_offset + uvs_num),
+            .normal_index = obj_index(nn, chunk->normals_offset + normals_num),
+        };
+        missing_normals_num += !nn;
+        // Offsets are only known when writing.
+        if (parse->write)
+          bad_index |= !corner.position_index ||
+                       corner.position_index == OBJ_BAD_INDEX ||
+                       corner.uv_index == OBJ_BAD_INDEX ||
+                       corner.normal_index == OBJ_BAD_INDEX;
+        if (n == 0)
+          first = corner;
+        if (2 <= n) {
+          if (parse->write && corners_num < chunk->corners_num) {
+            ModelFace *out =
+                &parse->corners[chunk->corners_offset + corners_num];
+            out[0] = first;
+            out[1] = prev;
+            out[2] = corner;
+          }
+          corners_num += 3;
+        }
+        prev = corner;
+        n++;
       }
-      break;
-    case 'f':
-      faces_num += 3;
-      SKIP_BEYOND(line, '\n')
-      break;
-    default:
-      SKIP_BEYOND(line, '\n')
-      break;
     }
+    c = line_end + 1;
   }
 
-  V3 *positions = frame_alloc_array(memory, V3, positions_num);
-  V3 *normals = frame_alloc_array(memory, V3, normals_num);
-  V2 *uvs = frame_alloc_array(memory, V2, uvs_num);
-  ModelFace *faces = frame_alloc_array(memory, ModelFace, faces_num);
-
-  line = (const char *)file_mem;
-
-  positions_num = 0;
-  normals_num = 0;
-  uvs_num = 0;
-  faces_num = 0;
-
-  while (*line) {
-    switch (*line) {
-    case 'v':
-      line++;
-      switch (*line) {
-      case ' ':
-        positions[positions_num].x = strtof(line, &end);
-        line = end;
-        positions[positions_num].y = strtof(line, &end);
-        line = end;
-        positions[positions_num].z = strtof(line, &end);
-        positions_num++;
-        SKIP_BEYOND(line, '\n')
-        break;
-      case 'n':
-        line++;
-        normals[normals_num].x = strtof(line, &end);
-        line = end;
-        normals[normals_num].y = strtof(line, &end);
-        line = end;
-        normals[normals_num].z = strtof(line, &end);
-        normals_num++;
-        SKIP_BEYOND(line, '\n')
-        break;
-      case 't':
-        line++;
-        uvs[uvs_num].x = strtof(line, &end);
-        line = end;
-        uvs[uvs_num].y = strtof(line, &end);
-        uvs_num++;
-        SKIP_BEYOND(line, '\n')
-        break;
-      default:
-        SKIP_BEYOND(line, '\n')
-        break;
-      }
+  chunk->positions_num = positions_num;
+  chunk->uvs_num = uvs_num;
+  chunk->normals_num = normals_num;
+  chunk->corners_num = corners_num;
+  chunk->missing_normals_num = missing_normals_num;
+  chunk->bad_index = bad_index;
+}
+
+// Splits lines in [start, end) into chunks of about OBJ_CHUNK_SIZE. Chunks
+// end after the first new line past their nominal end, so every line is
+// parsed by exactly one chunk.
+u32 obj_split_chunks(ObjChunk *chunks, const char *start, const char *end) {
+  u32 chunks_num = MAX(1, (end - start + OBJ_CHUNK_SIZE - 1) / OBJ_CHUNK_SIZE);
+  const char *chunk_start = start;
+  for (u32 i = 0; i < chunks_num; i++) {
+    const char *chunk_end = end;
+    if (i + 1 < chunks_num) {
+      chunk_end = MAX(chunk_start, start + (u64)(i + 1) * OBJ_CHUNK_SIZE);
+      const char *new_line = memchr(chunk_end, '\n', end - chunk_end);
+      chunk_end = new_line ? new_line + 1 : end;
+    }
+    chunks[i] = (ObjChunk){.start = chunk_start, .end = chunk_end};
+    chunk_start = chunk_end;
+  }
+  return chunks_num;
+}
+
+// The file is read in windows of whole lines, so parsing needs a fixed
+// amount of memory whatever the size of the file.
+#define OBJ_WINDOW_SIZE (4 * 1024 * 1024)
+#define OBJ_WINDOW_CHUNKS (OBJ_WINDOW_SIZE / OBJ_CHUNK_SIZE)
+
+typedef struct {
+  i32 fd;
+  char *window;
+  u32 filled;
+  u32 used;
+  bool eof;
+} ObjReader;
+
+// Gives the next window of whole lines, false at the end of the file. The
+// partial line at the end of a window starts the next one.
+bool obj_read_lines(ObjReader *reader, const char **start, const char **end) {
+  reader->filled -= reader->used;
+  memmove(reader->window, reader->window + reader->used, reader->filled);
+  reader->used = 0;
+  while (!reader->eof && reader->filled < OBJ_WINDOW_SIZE) {
+    i64 n = read(reader->fd, reader->window + reader->filled,
+                 OBJ_WINDOW_SIZE - reader->filled);
+    ASSERT((0 <= n), "Failed to read OBJ file");
+    reader->eof = n == 0;
+    reader->filled += n;
+  }
+  if (!reader->filled)
+    return false;
+
+  reader->used = reader->filled;
+  if (!reader->eof) {
+    while (reader->used && reader->window[reader->used - 1] != '\n')
+      reader->used--;
+    ASSERT(reader->used, "OBJ line longer than %d bytes", OBJ_WINDOW_SIZE);
+  }
+  *start = reader->window;
+  *end = reader->window + reader->used;
+  return true;
+}
+
+void obj_rewind(ObjReader *reader) {
+  lseek(reader->fd, 0, SEEK_SET);
+  reader->filled = 0;
+  reader->used = 0;
+  reader->eof = false;
+}
+
+// Loading scratch lives outside of the arenas and is unmapped at the end.
+void *obj_scratch_map(u64 size) {
+  void *ptr = mmap(NULL, MAX(size, 1), PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  ASSERT((ptr != MAP_FAILED), "Failed to map %lu bytes of scratch", size);
+  return ptr;
+}
+
+void obj_scratch_unmap(void *ptr, u64 size) { munmap(ptr, MAX(size, 1)); }
+
+// Vertex made from a corner tuple. Position indices are 1 based, so 0 marks
+// an empty slot.
+typedef struct {
+  ModelFace corner;
+  u32 vertex;
+} ObjVertexSlot;
+
+u32 obj_vertex_slot(ObjVertexSlot *table, u32 table_size, ModelFace *corner) {
+  u32 slot = (corner->position_index * 73856093u ^
+              corner->uv_index * 19349663u ^
+              corner->normal_index * 83492791u) &
+             (table_size - 1);
+  while (table[slot].corner.position_index) {
+    ModelFace *other = &table[slot].corner;
+    if (other->position_index == corner->position_index &&
+        other->uv_index == corner->uv_index &&
+        other->normal_index == corner->normal_index)
       break;
-    case 'f':
-      line++;
-      faces[faces_num].position_index = strtoul(line, &end, 10);
-      line = end + 1;
-      faces[faces_num].uv_index = strtoul(line, &end, 10);
-      line = end + 1;
-      faces[faces_num].normal_index = strtoul(line, &end, 10);
-      line = end + 1;
-      faces[faces_num + 1].position_index = strtoul(line, &end, 10);
-      line = end + 1;
-      faces[faces_num + 1].uv_index = strtoul(line, &end, 10);
-      line = end + 1;
-      faces[faces_num + 1].normal_index = strtoul(line, &end, 10);
-      line = end + 1;
-      faces[faces_num + 2].position_index = strtoul(line, &end, 10);
-      line = end + 1;
-      faces[faces_num + 2].uv_index = strtoul(line, &end, 10);
-      line = end + 1;
-      faces[faces_num + 2].normal_index = strtoul(line, &end, 10);
-      faces_num += 3;
-      SKIP_BEYOND(line, '\n')
+    slot = (slot + 1) & (table_size - 1);
+  }
+  return slot;
+}
+
+// Loads an OBJ file in two passes over windows of the file. The first one
+// counts the elements of every chunk, the second one parses every chunk once
+// more at the offsets given by the counts and turns every corner into an
+// index, with corners of the same position/uv/normal tuple sharing
+// one vertex. Besides the model, the memory used is a window, the positions,
+// uvs and normals of the file and the vertices made with their table. Faces
+// can only use elements defined before them. Returns false when the file is
+// missing, a face uses an element that is not defined or the file changes
+// while loading.
+bool load_model(Memory *memory, ThreadPool *pool, const char *obj_path,
+                u32 flags, Model *model) {
+  i32 fd = open(obj_path, O_RDONLY);
+  if (fd < 0) {
+    WARN("Failed to open OBJ file: %s", obj_path);
+    return false;
+  }
+
+  ObjReader reader = {.fd = fd, .window = obj_scratch_map(OBJ_WINDOW_SIZE)};
+  ObjParse parse = {0};
+  const char *start;
+  const char *end;
+
+  // Chunks of the whole file with their counts.
+  u32 counts_capacity = 64;
+  ObjChunk *counts = obj_scratch_map(sizeof(ObjChunk) * counts_capacity);
+  u32 counts_num = 0;
+  ObjChunk totals = {0};
+  while (obj_read_lines(&reader, &start, &end)) {
+    if (counts_capacity < counts_num + OBJ_WINDOW_CHUNKS + 1) {
+      ObjChunk *old_counts = counts;
+      counts = obj_scratch_map(sizeof(ObjChunk) * counts_capacity * 2);
+      memcpy(counts, old_counts, sizeof(ObjChunk) * counts_num);
+      obj_scratch_unmap(old_counts, sizeof(ObjChunk) * counts_capacity);
+      counts_capacity *= 2;
+    }
+    ObjChunk *chunks = &counts[counts_num];
+    u32 chunks_num = obj_split_chunks(chunks, start, end);
+    parse.chunks = chunks;
+    thread_pool_run(pool, obj_parse_chunk, &parse, chunks_num);
+    for (u32 i = 0; i < chunks_num; i++) {
+      totals.positions_num += chunks[i].positions_num;
+      totals.uvs_num += chunks[i].uvs_num;
+      totals.normals_num += chunks[i].normals_num;
+      totals.corners_num += chunks[i].corners_num;
+      totals.missing_normals_num += chunks[i].missing_normals_num;
+    }
+    counts_num += chunks_num;
+  }
+
+  u32 indices_num = totals.corners_num;
+  ScratchMark perm_mark = scratch_mark(&memory->perm_memory);
+  u32 *indices = perm_alloc_array(memory, u32, indices_num);
+  ASSERT(indices, "Model %s does not fit in perm memory", obj_path);
+  // Every corner can be a new vertex. Only the pages of the vertices made
+  // are backed, and they are copied to the perm memory once known.
+  Vertex *vertices = obj_scratch_map(sizeof(Vertex) * indices_num);
+  u32 vertices_num = 0;
+
+  V3 *positions = obj_scratch_map(sizeof(V3) * totals.positions_num);
+  V2 *uvs = obj_scratch_map(sizeof(V2) * totals.uvs_num);
+  V3 *normals = obj_scratch_map(sizeof(V3) * totals.normals_num);
+  // Corners without a normal take the area weighted normal of the faces
+  // around their position.
+  V3 *smooth_normals = NULL;
+  if (totals.missing_normals_num)
+    smooth_normals = obj_scratch_map(sizeof(V3) * totals.positions_num);
+
+  u32 table_size = 1024;
+  ObjVertexSlot *table = obj_scratch_map(sizeof(ObjVertexSlot) * table_size);
+  u32 corners_capacity = 0;
+  ModelFace *corners = NULL;
+
+  parse.positions = positions;
+  parse.uvs = uvs;
+  parse.normals = normals;
+
+  obj_rewind(&reader);
+  ObjChunk done = {0};
+  u32 chunks_done = 0;
+  u32 indices_done = 0;
+  const char *error = NULL;
+  while (!error && obj_read_lines(&reader, &start, &end)) {
+    // The windows and their chunks are the same as in the first pass.
+    ObjChunk chunks[OBJ_WINDOW_CHUNKS + 1];
+    u32 chunks_num = obj_split_chunks(chunks, start, end);
+    if (counts_num < chunks_done + chunks_num)
+      error = "changed while loading";
+    for (u32 i = 0; !error && i < chunks_num; i++) {
+      ObjChunk *counted = &counts[chunks_done + i];
+      if (chunks[i].start != counted->start || chunks[i].end != counted->end)
+        error = "changed while loading";
+      chunks[i] = *counted;
+    }
+    if (error)
       break;
-    default:
-      SKIP_BEYOND(line, '\n')
+
+    u32 corners_num = 0;
+    for (u32 i = 0; i < chunks_num; i++) {
+      chunks[i].positions_offset = done.positions_num;
+      chunks[i].uvs_offset = done.uvs_num;
+      chunks[i].normals_offset = done.normals_num;
+      chunks[i].corners_offset = corners_num;
+      done.positions_num += chunks[i].positions_num;
+      done.uvs_num += chunks[i].uvs_num;
+      done.normals_num += chunks[i].normals_num;
+      corners_num += chunks[i].corners_num;
+    }
+    if (corners_capacity < corners_num) {
+      obj_scratch_unmap(corners, sizeof(ModelFace) * corners_capacity);
+      corners_capacity = MAX(corners_num, corners_capacity * 2);
+      corners = obj_scratch_map(sizeof(ModelFace) * corners_capacity);
+    }
+
+    parse.chunks = chunks;
+    parse.corners = corners;
+    parse.write = true;
+    thread_pool_run(pool, obj_parse_chunk, &parse, chunks_num);
+    for (u32 i = 0; !error && i < chunks_num; i++) {
+      ObjChunk *counted = &counts[chunks_done + i];
+      if (chunks[i].bad_index)
+        error = "uses an element that is not defined";
+      else if (chunks[i].positions_num != counted->positions_num ||
+               chunks[i].uvs_num != counted->uvs_num ||
+               chunks[i].normals_num != counted->normals_num ||
+               chunks[i].corners_num != counted->corners_num)
+        error = "changed while loading";
+    }
+    if (error)
       break;
+    chunks_done += chunks_num;
+
+    for (u32 i = 0; i < corners_num; i++) {
+      ModelFace *corner = &corners[i];
+      if (table_size < (vertices_num + 1) * 2) {
+        ObjVertexSlot *old_table = table;
+        u32 old_size = table_size;
+        table_size *= 2;
+        table = obj_scratch_map(sizeof(ObjVertexSlot) * table_size);
+        for (u32 j = 0; j < old_size; j++)
+          if (old_table[j].corner.position_index)
+            table[obj_vertex_slot(table, table_size, &old_table[j].corner)] =
+                old_table[j];
+        obj_scratch_unmap(old_table, sizeof(ObjVertexSlot) * old_size);
+      }
+
+      ObjVertexSlot *slot = &table[obj_vertex_slot(table, table_size, corner)];
+      if (!slot->corner.position_index) {
+        slot->corner = *corner;
+        slot->vertex = vertices_num;
+        Vertex *vertex = &vertices[vertices_num++];
+        vertex->position = positions[corner->position_index - 1];
+        vertex->normal = corner->normal_index
+                             ? normals[corner->normal_index - 1]
+                             : (V3){0};
+        vertex->uv = corner->uv_index ? uvs[corner->uv_index - 1] : (V2){0};
+      }
+      indices[indices_done++] = slot->vertex;
+    }
+
+    if (smooth_normals) {
+      for (u32 i = 0; i < corners_num; i += 3) {
+        u32 a = corners[i].position_index - 1;
+        u32 b = corners[i + 1].position_index - 1;
+        u32 c = corners[i + 2].position_index - 1;
+        V3 n = v3_cross(v3_sub(positions[b], positions[a]),
+                        v3_sub(positions[c], positions[a]));
+        smooth_normals[a] = v3_add(smooth_normals[a], n);
+        smooth_normals[b] = v3_add(smooth_normals[b], n);
+        smooth_normals[c] = v3_add(smooth_normals[c], n);
+      }
     }
   }
 
-  u32 vertices_num = faces_num;
-  Vertex *vertices = perm_alloc_array(memory, Vertex, vertices_num);
-  u32 indices_num = faces_num;
-  u32 *indices = perm_alloc_array(memory, u32, indices_num);
+  if (!error && chunks_done != counts_num)
+    error = "changed while loading";
 
-  for (u32 i = 0; i < faces_num; i++) {
-    ModelFace *face = &faces[i];
-    vertices[i].position = positions[face->position_index - 1];
-    vertices[i].normal = normals[face->normal_index - 1];
-    vertices[i].uv = uvs[face->uv_index - 1];
-    indices[i] = i;
+  if (!error && smooth_normals) {
+    for (u32 i = 0; i < totals.positions_num; i++) {
+      f32 len = v3_len(smooth_normals[i]);
+      if (len != 0.0f)
+        smooth_normals[i] = v3_div(smooth_normals[i], len);
+    }
+    for (u32 i = 0; i < table_size; i++)
+      if (table[i].corner.position_index && !table[i].corner.normal_index)
+        vertices[table[i].vertex].normal =
+            smooth_normals[table[i].corner.position_index - 1];
   }
+  if (smooth_normals)
+    obj_scratch_unmap(smooth_normals, sizeof(V3) * totals.positions_num);
 
-  munmap(file_mem, sb.st_size);
+  obj_scratch_unmap(table, sizeof(ObjVertexSlot) * table_size);
+  obj_scratch_unmap(corners, sizeof(ModelFace) * corners_capacity);
+  obj_scratch_unmap(normals, sizeof(V3) * totals.normals_num);
+  obj_scratch_unmap(uvs, sizeof(V2) * totals.uvs_num);
+  obj_scratch_unmap(positions, sizeof(V3) * totals.positions_num);
+  obj_scratch_unmap(counts, sizeof(ObjChunk) * counts_capacity);
+  obj_scratch_unmap(reader.window, OBJ_WINDOW_SIZE);
   close(fd);
-  INFO("Loaded model %s with %d vertices", obj_path, vertices_num);
+  if (error) {
+    WARN("OBJ file %s %s", obj_path, error);
+    obj_scratch_unmap(vertices, sizeof(Vertex) * indices_num);
+    scratch_restore(perm_mark);
+    return false;
+  }
+
+  Vertex *vertices_scratch = vertices;
+  vertices = perm_alloc_array(memory, Vertex, vertices_num);
+  ASSERT(vertices, "Model %s does not fit in perm memory", obj_path);
+  memcpy(vertices, vertices_scratch, sizeof(Vertex) * vertices_num);
+  obj_scratch_unmap(vertices_scratch, sizeof(Vertex) * indices_num);
+
+  if (flags & ModelLoadOptimize) {
+    Model bounds = {.vertices = vertices, .vertices_num = vertices_num};
+    model_compute_bounds(&bounds);
+    f32 acmr = vertex_cache_acmr(memory, indices, indices_num, vertices_num);
+    f32 overdraw =
+        model_overdraw(memory, vertices, indices, indices_num, &bounds.sphere);
+    optimize_vertex_cache(memory, indices, indices_num, vertices_num);
+    optimize_overdraw(memory, vertices, vertices_num, indices, indices_num);
+    optimize_vertex_fetch(memory, vertices, vertices_num, indices,
+                          indices_num);
+    INFO("Optimized model %s, ACMR %.3f -> %.3f, overdraw %.3f -> %.3f",
+         obj_path, acmr,
+         vertex_cache_acmr(memory, indices, indices_num, vertices_num),
+         overdraw,
+         model_overdraw(memory, vertices, indices, indices_num,
+                        &bounds.sphere));
+  }
+
+  INFO("Loaded model %s with %d vertices and %d triangles", obj_path,
+       vertices_num, indices_num / 3);
 
-  Model model = {
+  *model = (Model){
       .vertices = vertices,
       .vertices_num = vertices_num,
       .indices = indices,
       .indices_num = indices_num,
   };
+  model_compute_bounds(model);
+  if (flags & ModelLoadMeshlets) {
+    model_compute_meshlets(memory, model);
+    INFO("Split model %s into %d meshlets", obj_path, model->meshlets_num);
+  }
+  model_compute_face_planes(memory, model);
+  if (flags & ModelLoadStreams)
+    model_compute_streams(memory, model);
+  if (flags & ModelLoadLods) {
+    model_compute_lods(memory, model);
+    for (u32 i = 0; i < model->lods_num; i++)
+      INFO("Model %s LOD %d with %d triangles and error %f", obj_path, i,
+           model->lods[i].indices_num / 3, model->lods[i].error);
+  }
+
+  return true;
+}
+
+// Binary mesh file. The header holds the counts, bounds and flags of the
+// model and the offsets of its arrays, which follow in the `mesh_file_arrays`
+// order, each aligned to MESH_FILE_ALIGNMENT. Arrays hold the `f32` and `u32`
+// fields of their elements without padding in the byte order of the host,
+// files of the other byte order fail the magic check. The loader maps the
+// file, validates the counts and the indices and points the model into it.
+#define MESH_FILE_MAGIC 0x48534D53
+#define MESH_FILE_VERSION 3
+#define MESH_FILE_ALIGNMENT 64
+#define MESH_FILE_ARRAYS_MAX (2 + 4 + 3 + 1 + (MODEL_LODS_MAX - 1) * 5)
+
+typedef enum {
+  MeshFileStreams = 1 << 0,
+  MeshFileMeshlets = 1 << 1,
+  MeshFileLods = 1 << 2,
+} MeshFileFlags;
+
+typedef struct {
+  u32 indices_num;
+  f32 error;
+  f32 face_planes_d_max;
+} MeshFileLod;
+
+typedef struct {
+  u32 magic;
+  u32 version;
+  u32 flags;
+  u32 vertices_num;
+  u32 indices_num;
+  u32 meshlets_num;
+  u32 lods_num;
+  f32 face_planes_d_max;
+  AABB3 aabb;
+  Sphere sphere;
+  MeshFileLod lods[MODEL_LODS_MAX];
+  u32 arrays_num;
+  // Keeps the offsets 8 byte aligned without implicit padding.
+  u32 pad;
+  u64 offsets[MESH_FILE_ARRAYS_MAX];
+} MeshFileHeader;
+
+typedef struct {
+  void **data;
+  u64 size;
+} MeshFileArray;
+
+// Arrays of the model stored in the file. Sizes come from the counts of the
+// header and optional arrays are stored when their flags are set. Returns the
+// number of arrays.
+u32 mesh_file_arrays(MeshFileHeader *header, Model *model,
+                     MeshFileArray *arrays, u32 arrays_max) {
+  u32 arrays_num = 0;
+#define MESH_FILE_ARRAY(array, num)                                            \
+  ASSERT((arrays_num < arrays_max), "Too many mesh file arrays");              \
+  arrays[arrays_num++] =                                                       \
+      (MeshFileArray){(void **)&(array), sizeof(*(array)) * (u64)(num)};
+
+  MESH_FILE_ARRAY(model->vertices, header->vertices_num)
+  MESH_FILE_ARRAY(model->indices, header->indices_num)
+  FacePlanes *planes = &model->face_planes;
+  u32 padded = face_planes_padded_num(header->indices_num / 3);
+  MESH_FILE_ARRAY(planes->nx, padded)
+  MESH_FILE_ARRAY(planes->ny, padded)
+  MESH_FILE_ARRAY(planes->nz, padded)
+  MESH_FILE_ARRAY(planes->d, padded)
+  if (header->flags & MeshFileStreams) {
+    VertexStreams *streams = &model->streams;
+    u32 streams_num = (header->vertices_num + VERTEX_STREAMS_BATCH - 1) &
+                      ~(VERTEX_STREAMS_BATCH - 1);
+    MESH_FILE_ARRAY(streams->x, streams_num)
+    MESH_FILE_ARRAY(streams->y, streams_num)
+    MESH_FILE_ARRAY(streams->z, streams_num)
+  }
+  if (header->flags & MeshFileMeshlets)
+    MESH_FILE_ARRAY(model->meshlets, header->meshlets_num)
+  // Level 0 is the model itself.
+  for (u32 i = 1; i < header->lods_num; i++) {
+    ModelLod *lod = &model->lods[i];
+    planes = &lod->face_planes;
+    padded = face_planes_padded_num(header->lods[i].indices_num / 3);
+    MESH_FILE_ARRAY(lod->indices, header->lods[i].indices_num)
+    MESH_FILE_ARRAY(planes->nx, padded)
+    MESH_FILE_ARRAY(planes->ny, padded)
+    MESH_FILE_ARRAY(planes->nz, padded)
+    MESH_FILE_ARRAY(planes->d, padded)
+  }
+
+#undef MESH_FILE_ARRAY
+  return arrays_num;
+}
+
+static inline u64 mesh_file_align(u64 offset) {
+  return (offset + MESH_FILE_ALIGNMENT - 1) & ~(u64)(MESH_FILE_ALIGNMENT - 1);
+}
+
+void save_mesh(Model *model, const char *mesh_path) {
+  ASSERT((model->lods_num <= MODEL_LODS_MAX), "Model has %d LODs",
+         model->lods_num);
+  i32 fd = open(mesh_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  ASSERT((0 < fd), "Failed to open mesh file: %s", mesh_path);
+
+  MeshFileHeader header = {
+      .magic = MESH_FILE_MAGIC,
+      .version = MESH_FILE_VERSION,
+      .flags = (model->streams.x ? MeshFileStreams : 0) |
+               (model->meshlets ? MeshFileMeshlets : 0) |
+               (model->lods_num ? MeshFileLods : 0),
+      .vertices_num = model->vertices_num,
+      .indices_num = model->indices_num,
+      .meshlets_num = model->meshlets ? model->meshlets_num : 0,
+      .lods_num = model->lods_num,
+      .face_planes_d_max = model->face_planes.d_max,
+      .aabb = model->aabb,
+      .sphere = model->sphere,
+  };
+  for (u32 i = 0; i < model->lods_num; i++)
+    header.lods[i] = (MeshFileLod){
+        .indices_num = model->lods[i].indices_num,
+        .error = model->lods[i].error,
+        .face_planes_d_max = model->lods[i].face_planes.d_max,
+    };
+  MeshFileArray arrays[MESH_FILE_ARRAYS_MAX];
+  header.arrays_num =
+      mesh_file_arrays(&header, model, arrays, MESH_FILE_ARRAYS_MAX);
+
+  u64 offset = mesh_file_align(sizeof(MeshFileHeader));
+  for (u32 i = 0; i < header.arrays_num; i++) {
+    header.offsets[i] = offset;
+    ASSERT((pwrite(fd, *arrays[i].data, arrays[i].size, offset) ==
+            (i64)arrays[i].size),
+           "Failed to write mesh file: %s", mesh_path);
+    offset = mesh_file_align(offset + arrays[i].size);
+  }
+  ASSERT((pwrite(fd, &header, sizeof(header), 0) == sizeof(header)),
+         "Failed to write mesh file: %s", mesh_path);
+  ASSERT((ftruncate(fd, offset) == 0), "Failed to write mesh file: %s",
+         mesh_path);
+  close(fd);
+  INFO("Saved mesh %s with %d arrays and %lu bytes", mesh_path,
+       header.arrays_num, offset);
+}
+
+// Counts of the header the arrays can be sized by.
+bool mesh_file_counts_valid(MeshFileHeader *header) {
+  if (header->indices_num % 3)
+    return false;
+  if (!(header->flags & MeshFileMeshlets) && header->meshlets_num)
+    return false;
+  // Level 0 is required with the LODs and is the model itself.
+  if (header->flags & MeshFileLods) {
+    if (!header->lods_num || MODEL_LODS_MAX < header->lods_num ||
+        header->lods[0].indices_num != header->indices_num)
+      return false;
+  } else if (header->lods_num) {
+    return false;
+  }
+  for (u32 i = 1; i < header->lods_num; i++)
+    if (header->lods[i].indices_num % 3)
+      return false;
+  return true;
+}
+
+bool mesh_indices_valid(u32 *indices, u32 indices_num, u32 vertices_num) {
+  u32 max_index = 0;
+  for (u32 i = 0; i < indices_num; i++)
+    max_index = MAX(max_index, indices[i]);
+  return !indices_num || max_index < vertices_num;
+}
+
+// Maps the mesh file and points the model into the mapping, which is never
+// unmapped. Returns false when the file is missing, was written by a
+// different version or is corrupted.
+bool load_mesh(const char *mesh_path, Model *model) {
+  i32 fd = open(mesh_path, O_RDONLY);
+  if (fd < 0)
+    return false;
+
+  struct stat sb;
+  ASSERT((fstat(fd, &sb) != -1), "Failed to get a mesh file %s size",
+         mesh_path);
+  u64 file_size = sb.st_size;
+  if (file_size < sizeof(MeshFileHeader)) {
+    WARN("Mesh file %s is too small", mesh_path);
+    close(fd);
+    return false;
+  }
+
+  u8 *file_mem = mmap(NULL, file_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  ASSERT((file_mem != MAP_FAILED), "Failed to mmap mesh file: %s", mesh_path);
+
+  MeshFileHeader *header = (MeshFileHeader *)file_mem;
+  if (header->magic != MESH_FILE_MAGIC ||
+      header->version != MESH_FILE_VERSION) {
+    WARN("Mesh file %s has version %d, expected %d", mesh_path,
+         header->version, MESH_FILE_VERSION);
+    munmap(file_mem, file_size);
+    return false;
+  }
+
+  Model result = {
+      .vertices_num = header->vertices_num,
+      .indices_num = header->indices_num,
+      .aabb = header->aabb,
+      .sphere = header->sphere,
+      .face_planes = {.faces_num = header->indices_num / 3,
+                      .d_max = header->face_planes_d_max},
+      .meshlets_num = header->meshlets_num,
+      .lods_num = header->lods_num,
+  };
+  MeshFileArray arrays[MESH_FILE_ARRAYS_MAX];
+  bool valid = mesh_file_counts_valid(header);
+  if (valid) {
+    u32 arrays_num =
+        mesh_file_arrays(header, &result, arrays, MESH_FILE_ARRAYS_MAX);
+    valid = arrays_num == header->arrays_num;
+  }
+  for (u32 i = 0; valid && i < header->arrays_num; i++) {
+    u64 offset = header->offsets[i];
+    valid = offset % MESH_FILE_ALIGNMENT == 0 && offset <= file_size &&
+            arrays[i].size <= file_size - offset;
+    *arrays[i].data = file_mem + offset;
+  }
+  if (valid && (header->flags & MeshFileStreams))
+    result.streams.padded_num =
+        (result.vertices_num + VERTEX_STREAMS_BATCH - 1) &
+        ~(VERTEX_STREAMS_BATCH - 1);
+  for (u32 i = 0; valid && i < result.lods_num; i++) {
+    ModelLod *lod = &result.lods[i];
+    lod->indices_num = header->lods[i].indices_num;
+    lod->error = header->lods[i].error;
+    lod->face_planes.faces_num = lod->indices_num / 3;
+    lod->face_planes.d_max = header->lods[i].face_planes_d_max;
+  }
+  if (valid && result.lods_num) {
+    result.lods[0].indices = result.indices;
+    result.lods[0].face_planes = result.face_planes;
+  }
+
+  // Every index is checked once here, so the rasterizer never reads outside
+  // of the vertices of a corrupted file.
+  valid = valid && mesh_indices_valid(result.indices, result.indices_num,
+                                      result.vertices_num);
+  for (u32 i = 1; valid && i < result.lods_num; i++)
+    valid = mesh_indices_valid(result.lods[i].indices,
+                               result.lods[i].indices_num,
+                               result.vertices_num);
+  for (u32 i = 0; valid && i < result.meshlets_num; i++) {
+    Meshlet *meshlet = &result.meshlets[i];
+    valid = (u64)meshlet->triangle_offset + meshlet->triangles_num <=
+                result.face_planes.faces_num &&
+            meshlet->triangles_num <= MESHLET_MAX_TRIANGLES &&
+            meshlet->vertices_num <= MESHLET_MAX_VERTICES;
+  }
+  if (!valid) {
+    WARN("Mesh file %s is corrupted", mesh_path);
+    munmap(file_mem, file_size);
+    return false;
+  }
+
+  *model = result;
+  INFO("Mapped mesh %s with %d vertices and %d triangles", mesh_path,
+       model->vertices_num, model->indices_num / 3);
+  return true;
+}
+
+// Post-transform vertex, the model vertex in the clip space and on the screen.
+// The screen position is only valid in front of the near plane.
+typedef struct {
+  V4 position;
+  V3 screen;
+  u32 outcode;
+} TransformedVertex;
+
+// Transforms the `vertices` of the model, or all of them when it is NULL,
+// once. The result is indexed the same way as `model->vertices`, entries of
+// the vertices not in the list are not set. Positions are taken from the
+// model streams when it has them, the listed ones are gathered from them.
+TransformedVertex *transform_vertices(Memory *memory, Model *model,
+                                      u32 *vertices, u32 vertices_num,
+                                      Mat4 *mvp, f32 max_depth,
+                                      f32 window_width, f32 window_hight) {
+  u32 num = vertices ? vertices_num : model->vertices_num;
+  V3Array streams = {model->streams.x, model->streams.y, model->streams.z};
+  V3Array in = streams;
+  if (vertices || !streams.x) {
+    in.x = frame_alloc_array(memory, f32, num);
+    in.y = frame_alloc_array(memory, f32, num);
+    in.z = frame_alloc_array(memory, f32, num);
+  }
+  if (vertices && streams.x) {
+    for (u32 i = 0; i < num; i++) {
+      in.x[i] = streams.x[vertices[i]];
+      in.y[i] = streams.y[vertices[i]];
+      in.z[i] = streams.z[vertices[i]];
+    }
+  } else if (!streams.x) {
+    for (u32 i = 0; i < num; i++) {
+      V3 p = model->vertices[vertices ? vertices[i] : i].position;
+      in.x[i] = p.x;
+      in.y[i] = p.y;
+      in.z[i] = p.z;
+    }
+  }
+  V4Array clip = {
+      frame_alloc_array(memory, f32, num),
+      frame_alloc_array(memory, f32, num),
+      frame_alloc_array(memory, f32, num),
+      frame_alloc_array(memory, f32, num),
+  };
+  V3Array screen = {
+      frame_alloc_array(memory, f32, num),
+      frame_alloc_array(memory, f32, num),
+      frame_alloc_array(memory, f32, num),
+  };
+  mat4_project_batch(mvp, in, num, window_width, window_hight, clip, screen);
+
+  TransformedVertex *result =
+      frame_alloc_array(memory, TransformedVertex, model->vertices_num);
+  for (u32 i = 0; i < num; i++) {
+    TransformedVertex *t = &result[vertices ? vertices[i] : i];
+    t->position = (V4){clip.x[i], clip.y[i], clip.z[i], clip.w[i]};
+    t->screen = (V3){screen.x[i], screen.y[i], screen.z[i]};
+    t->outcode = clip_outcode(t->position, max_depth);
+  }
+  return result;
+}
+
+// Transforms the `faces` of the model to the screen. Triangles crossing the
+// near plane or the guard band are clipped and triangles fully outside of the
+// screen are dropped, so the rasterizer only gets bounded triangles. Clipped
+// vertices are allocated in the frame memory. Returns the number of
+// triangles.
+u32 project_model(Memory *memory, Model *model, u32 *faces, u32 faces_num,
+                  Mat4 *mvp, f32 max_depth, f32 window_width,
+                  f32 window_hight, Triangle **triangles) {
+  // Only the vertices of the culled faces are transformed.
+  u8 *used = frame_alloc_array(memory, u8, model->vertices_num);
+  memset(used, 0, model->vertices_num);
+  u32 *vertices = frame_alloc_array(memory, u32, model->vertices_num);
+  u32 vertices_num = 0;
+  for (u32 f = 0; f < faces_num; f++) {
+    for (u32 c = 0; c < 3; c++) {
+      u32 v = model->indices[faces[f] * 3 + c];
+      if (!used[v]) {
+        used[v] = true;
+        vertices[vertices_num++] = v;
+      }
+    }
+  }
+  TransformedVertex *transformed = transform_vertices(
+      memory, model, vertices_num < model->vertices_num ? vertices : NULL,
+      vertices_num, mvp, max_depth, window_width, window_hight);
+
+  u32 triangles_max = 0;
+  for (u32 f = 0; f < faces_num; f++) {
+    u32 *index = &model->indices[faces[f] * 3];
+    u32 c0 = transformed[index[0]].outcode;
+    u32 c1 = transformed[index[1]].outcode;
+    u32 c2 = transformed[index[2]].outcode;
+    if (c0 & c1 & c2)
+      continue;
+    triangles_max += ((c0 | c1 | c2) & CLIP_PLANES) ? CLIP_MAX_TRIANGLES : 1;
+  }
+
+  Triangle *result = frame_alloc_array(memory, Triangle, triangles_max);
+  u32 triangles_num = 0;
+  for (u32 f = 0; f < faces_num; f++) {
+    u32 *index = &model->indices[faces[f] * 3];
+    TransformedVertex *t0 = &transformed[index[0]];
+    TransformedVertex *t1 = &transformed[index[1]];
+    TransformedVertex *t2 = &transformed[index[2]];
+    if (t0->outcode & t1->outcode & t2->outcode)
+      continue;
+
+    u32 planes = (t0->outcode | t1->outcode | t2->outcode) & CLIP_PLANES;
+    if (planes) {
+      Vertex *vertices[3] = {&model->vertices[index[0]],
+                             &model->vertices[index[1]],
+                             &model->vertices[index[2]]};
+      V4 positions[3] = {t0->position, t1->position, t2->position};
+      triangles_num +=
+          clip_triangle(memory, vertices, positions, planes, max_depth,
+                        window_width, window_hight, &result[triangles_num]);
+      continue;
+    }
+
+    Triangle t = {
+        .v0 = t0->screen,
+        .v0_vertex = &model->vertices[index[0]],
+        .v1 = t1->screen,
+        .v1_vertex = &model->vertices[index[1]],
+        .v2 = t2->screen,
+        .v2_vertex = &model->vertices[index[2]],
+    };
+    result[triangles_num++] = t;
+  }
 
-  return model;
+  *triangles = result;
+  return triangles_num;
 }
 
 #endif
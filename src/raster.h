@@ -0,0 +1,1526 @@
+#ifndef SOFTY_RASTER
+#define SOFTY_RASTER
+
+#include "defines.h"
+#include "log.h"
+#include "math.h"
+#include "memory.h"
+#include "primitives.h"
+#include "threads.h"
+
+#include <string.h>
+
+typedef enum {
+  Standard,
+  Barycentric,
+  Fixed,
+} TriangleMode;
+
+const char *triangle_mode_names[] = {"Standard", "Barycentric", "Fixed"};
+
+bool triangle_ccw(Triangle *triangle) {
+  f32 area =
+      0.5 *
+      ((triangle->v2.x - triangle->v0.x) * (triangle->v1.y - triangle->v0.y) -
+       (triangle->v1.x - triangle->v0.x) * (triangle->v2.y - triangle->v0.y));
+  return 0.0 < area;
+}
+
+bool triangle_culled(Triangle *triangle, CullMode cullmode) {
+  bool is_ccw = triangle_ccw(triangle);
+  switch (cullmode) {
+  case CCW:
+    return !is_ccw;
+  case CW:
+    return is_ccw;
+  case None:
+    break;
+  }
+  return false;
+}
+
+AABB raster_clip_aabb(BitMap *dst, Rect *rect_dst) {
+  if (rect_dst) {
+    ASSERT((rect_dst->width <= dst->width), "Invalid blit rect_dst");
+    ASSERT((rect_dst->hight <= dst->hight), "Invalid blit rect_dst");
+    return rect_aabb(rect_dst);
+  } else {
+    return (AABB){{0.0, 0.0}, {dst->width, dst->hight}};
+  }
+}
+
+// Edge function of the edge starting at `origin`:
+// `e(p) = a * (p.x - origin.x) + b * (p.y - origin.y)`
+// It is positive on the inner side of the edge.
+typedef struct {
+  f32 a;
+  f32 b;
+  V2 origin;
+} EdgeFunction;
+
+#define RASTER_BLOCK_SIZE 8
+
+typedef enum {
+  DepthF32,
+  // 16 bit unorm.
+  DepthUnorm16,
+  // 24 bit unorm in the low bits of a u32 with the high 8 bits unused.
+  DepthUnorm24,
+} DepthFormat;
+
+const char *depth_format_names[] = {"f32", "unorm16", "unorm24"};
+const u32 depth_format_bytes[] = {4, 2, 4};
+const f32 depth_format_unorm_max[] = {1.0f, 65535.0f, 16777215.0f};
+
+// Per pixel depth with an optional coarse HiZ layer. `hiz` holds one value
+// per RASTER_BLOCK_SIZE x RASTER_BLOCK_SIZE cell which is not greater than
+// any depth in the cell, so a block of a triangle that is not nearer than it
+// anywhere can be skipped. Larger depth is nearer and the buffer is cleared
+// to 0.
+// Unorm formats store `depth * unorm_scale` clamped to [0, 1] and depth test
+// the stored values. HiZ bounds stay in f32 depth, the mapping is monotonic
+// so the bounds hold for every format.
+// With the visibility buffer enabled rasterization only writes the id of the
+// nearest triangle per pixel into `ids` and `resolve_visibility` shades
+// every covered pixel once afterwards.
+typedef struct {
+  void *data;
+  DepthFormat format;
+  f32 unorm_scale;
+  u32 width;
+  u32 hight;
+  // NULL if the HiZ layer is disabled.
+  f32 *hiz;
+  u32 hiz_width;
+  // NULL if the visibility buffer is disabled. VISIBILITY_EMPTY for the
+  // pixels without triangles.
+  u32 *ids;
+} DepthBuffer;
+
+#define VISIBILITY_EMPTY 0xFFFFFFFF
+
+// `max_depth` is the depth mapped to 1 by the unorm formats, the depth of
+// the near plane.
+DepthBuffer depth_buffer_create(Memory *memory, u32 width, u32 hight,
+                                DepthFormat format, f32 max_depth, bool hiz,
+                                bool visibility) {
+  u32 size = width * hight * depth_format_bytes[format];
+  DepthBuffer depthbuffer = {
+      .data = frame_alloc_array(memory, u32, (size + 3) / 4),
+      .format = format,
+      .unorm_scale = 1.0f / max_depth,
+      .width = width,
+      .hight = hight,
+  };
+  memset(depthbuffer.data, 0, size);
+  if (hiz) {
+    depthbuffer.hiz_width = (width + RASTER_BLOCK_SIZE - 1) / RASTER_BLOCK_SIZE;
+    u32 hiz_hight = (hight + RASTER_BLOCK_SIZE - 1) / RASTER_BLOCK_SIZE;
+    u32 cells_num = depthbuffer.hiz_width * hiz_hight;
+    depthbuffer.hiz = frame_alloc_array(memory, f32, cells_num);
+    memset(depthbuffer.hiz, 0, cells_num * sizeof(f32));
+  }
+  if (visibility) {
+    depthbuffer.ids = frame_alloc_array(memory, u32, width * hight);
+    memset(depthbuffer.ids, 0xFF, width * hight * sizeof(u32));
+  }
+  return depthbuffer;
+}
+
+static inline u32 depth_to_unorm(DepthBuffer *depthbuffer, f32 depth) {
+  f32 d = MIN(MAX(depth * depthbuffer->unorm_scale, 0.0f), 1.0f);
+  return (u32)(d * depth_format_unorm_max[depthbuffer->format] + 0.5f);
+}
+
+// Depth tests the pixel `index` against `depth` and writes it on pass.
+static inline bool depth_test(DepthBuffer *depthbuffer, u32 index, f32 depth) {
+  switch (depthbuffer->format) {
+  case DepthF32: {
+    f32 *current = (f32 *)depthbuffer->data + index;
+    if (!(*current < depth))
+      return false;
+    *current = depth;
+    return true;
+  }
+  case DepthUnorm16: {
+    u16 *current = (u16 *)depthbuffer->data + index;
+    u32 d = depth_to_unorm(depthbuffer, depth);
+    if (!(*current < d))
+      return false;
+    *current = (u16)d;
+    return true;
+  }
+  case DepthUnorm24: {
+    u32 *current = (u32 *)depthbuffer->data + index;
+    u32 d = depth_to_unorm(depthbuffer, depth);
+    if (!(*current < d))
+      return false;
+    *current = d;
+    return true;
+  }
+  }
+  return false;
+}
+
+// Depth of the pixel `index` mapped to [0, 1].
+f32 depth_buffer_unorm(DepthBuffer *depthbuffer, u32 index) {
+  switch (depthbuffer->format) {
+  case DepthF32: {
+    f32 d = ((f32 *)depthbuffer->data)[index] * depthbuffer->unorm_scale;
+    return MIN(MAX(d, 0.0f), 1.0f);
+  }
+  case DepthUnorm16:
+    return (f32)((u16 *)depthbuffer->data)[index] /
+           depth_format_unorm_max[DepthUnorm16];
+  case DepthUnorm24:
+    return (f32)((u32 *)depthbuffer->data)[index] /
+           depth_format_unorm_max[DepthUnorm24];
+  }
+  return 0.0f;
+}
+
+// Values interpolated across the triangle.
+typedef enum {
+  AttributeDepth,
+  AttributeNormalX,
+  AttributeNormalY,
+  AttributeNormalZ,
+  AttributeU,
+  AttributeV,
+  ATTRIBUTES_NUM,
+} Attribute;
+
+// Plane equation of an attribute:
+// `a(p) = value + dx * (p.x - origin.x) + dy * (p.y - origin.y)`
+// where `origin` is the first vertex of the triangle.
+typedef struct {
+  f32 value;
+  f32 dx;
+  f32 dy;
+} AttributePlane;
+
+// Per triangle constants of the edge function rasterizer. Edge `i` is the
+// one opposite to the vertex `i`.
+// Pixels are sampled at their centers. Edge and attribute values are
+// evaluated directly once per row and once per RASTER_BLOCK_SIZE pixels
+// aligned span and stepped with `step_x` and `attribute_step_x` inside of
+// it. The value for a pixel depends only on its coordinates, so the result
+// does not depend on the clip rect.
+typedef struct {
+  EdgeFunction edges[3];
+  f32 step_x[3][RASTER_BLOCK_SIZE];
+  V2 origin;
+  AttributePlane attributes[ATTRIBUTES_NUM];
+  f32 attribute_step_x[ATTRIBUTES_NUM][RASTER_BLOCK_SIZE];
+  // Written to the visibility buffer instead of shading.
+  u32 id;
+} TriangleSetup;
+
+// Edge and attribute values at the first pixel of a span or a row.
+typedef struct {
+  f32 edges[3];
+  f32 attributes[ATTRIBUTES_NUM];
+} SpanValues;
+
+EdgeFunction edge_function(V3 from, V3 to) {
+  EdgeFunction e = {
+      .a = from.y - to.y,
+      .b = to.x - from.x,
+      .origin = from.xy,
+  };
+  return e;
+}
+
+// `area` is twice the signed area of the triangle.
+AttributePlane attribute_plane(Triangle *triangle, f32 a0, f32 a1, f32 a2,
+                               f32 area) {
+  V2 v0v1 = v2_sub(triangle->v1.xy, triangle->v0.xy);
+  V2 v0v2 = v2_sub(triangle->v2.xy, triangle->v0.xy);
+  f32 da1 = a1 - a0;
+  f32 da2 = a2 - a0;
+  AttributePlane plane = {
+      .value = a0,
+      .dx = (da1 * v0v2.y - da2 * v0v1.y) / area,
+      .dy = (da2 * v0v1.x - da1 * v0v2.x) / area,
+  };
+  return plane;
+}
+
+// Returns false for the degenerate triangles.
+bool triangle_setup(TriangleSetup *setup, Triangle *triangle) {
+  setup->edges[0] = edge_function(triangle->v1, triangle->v2);
+  setup->edges[1] = edge_function(triangle->v2, triangle->v0);
+  setup->edges[2] = edge_function(triangle->v0, triangle->v1);
+
+  // Twice the signed area of the triangle.
+  f32 area = v2_perp_dot(v2_sub(triangle->v1.xy, triangle->v0.xy),
+                         v2_sub(triangle->v2.xy, triangle->v0.xy));
+  if (area == 0.0)
+    return false;
+
+  Vertex *v0 = triangle->v0_vertex;
+  Vertex *v1 = triangle->v1_vertex;
+  Vertex *v2 = triangle->v2_vertex;
+  AttributePlane *planes = setup->attributes;
+  planes[AttributeDepth] = attribute_plane(
+      triangle, triangle->v0.z, triangle->v1.z, triangle->v2.z, area);
+  for (u32 i = 0; i < 3; i++)
+    planes[AttributeNormalX + i] = attribute_plane(
+        triangle, v0->normal.v[i], v1->normal.v[i], v2->normal.v[i], area);
+  planes[AttributeU] =
+      attribute_plane(triangle, v0->uv.x, v1->uv.x, v2->uv.x, area);
+  planes[AttributeV] =
+      attribute_plane(triangle, v0->uv.y, v1->uv.y, v2->uv.y, area);
+  setup->origin = triangle->v0.xy;
+
+  if (area < 0.0) {
+    for (u32 i = 0; i < 3; i++) {
+      setup->edges[i].a = -setup->edges[i].a;
+      setup->edges[i].b = -setup->edges[i].b;
+    }
+  }
+
+  for (u32 k = 0; k < RASTER_BLOCK_SIZE; k++) {
+    for (u32 i = 0; i < 3; i++)
+      setup->step_x[i][k] = setup->edges[i].a * (f32)k;
+    for (u32 i = 0; i < ATTRIBUTES_NUM; i++)
+      setup->attribute_step_x[i][k] = planes[i].dx * (f32)k;
+  }
+  return true;
+}
+
+static inline f32 edge_row(EdgeFunction *e, u32 y) {
+  return e->b * ((f32)y + 0.5 - e->origin.y);
+}
+
+static inline f32 edge_span(EdgeFunction *e, f32 row, u32 x) {
+  return e->a * ((f32)x + 0.5 - e->origin.x) + row;
+}
+
+// Offset of the center of the pixel row or column `p` from `origin`.
+static inline f32 pixel_offset(u32 p, f32 origin) {
+  return (f32)p + 0.5 - origin;
+}
+
+void span_values_row(TriangleSetup *setup, u32 y, SpanValues *row) {
+  for (u32 i = 0; i < 3; i++)
+    row->edges[i] = edge_row(&setup->edges[i], y);
+  f32 dy = pixel_offset(y, setup->origin.y);
+  for (u32 i = 0; i < ATTRIBUTES_NUM; i++)
+    row->attributes[i] =
+        setup->attributes[i].dy * dy + setup->attributes[i].value;
+}
+
+void span_values_span(TriangleSetup *setup, SpanValues *row, u32 x,
+                      SpanValues *span) {
+  for (u32 i = 0; i < 3; i++)
+    span->edges[i] = edge_span(&setup->edges[i], row->edges[i], x);
+  f32 dx = pixel_offset(x, setup->origin.x);
+  for (u32 i = 0; i < ATTRIBUTES_NUM; i++)
+    span->attributes[i] = setup->attributes[i].dx * dx + row->attributes[i];
+}
+
+static inline u32 normal_to_color(V3 normal) {
+  return (u32)(fabsf(normal.x * 255.0f)) << 16 |
+         (u32)(fabsf(normal.y * 255.0f)) << 8 |
+         (u32)(fabsf(normal.z * 255.0f)) << 0;
+}
+
+// Color of the pixel `k` of the span.
+static inline u32 shade_pixel(TriangleSetup *setup, SpanValues *span, u32 k) {
+  f32 *a = span->attributes;
+  f32(*step)[RASTER_BLOCK_SIZE] = setup->attribute_step_x;
+  V3 normal = {
+      .x = a[AttributeNormalX] + step[AttributeNormalX][k],
+      .y = a[AttributeNormalY] + step[AttributeNormalY][k],
+      .z = a[AttributeNormalZ] + step[AttributeNormalZ][k],
+  };
+  return normal_to_color(normal);
+}
+
+// Shades pixels [k_start, k_end) of the RASTER_BLOCK_SIZE pixels wide span
+// starting with `span` values. `depth_index` is the depth buffer index and
+// `color` points to the first pixel of the span. Pixels outside of the
+// triangle are skipped if `test_edges` is set.
+// All kernels do the same f32 operations in the same order, so they produce
+// bit-identical results.
+typedef void (*RasterSpanFn)(TriangleSetup *setup, DepthBuffer *depthbuffer,
+                             u32 depth_index, u32 *color, SpanValues *span,
+                             u32 k_start, u32 k_end, bool test_edges);
+
+// Depth tests and shades the pixel `k` of the span.
+static inline void shade_fragment(TriangleSetup *setup,
+                                  DepthBuffer *depthbuffer, u32 depth_index,
+                                  u32 *color, SpanValues *span, u32 k) {
+  f32 d = span->attributes[AttributeDepth] +
+          setup->attribute_step_x[AttributeDepth][k];
+  if (!depth_test(depthbuffer, depth_index, d))
+    return;
+  if (depthbuffer->ids)
+    depthbuffer->ids[depth_index] = setup->id;
+  else
+    *color = shade_pixel(setup, span, k);
+}
+
+void raster_span_scalar(TriangleSetup *setup, DepthBuffer *depthbuffer,
+                        u32 depth_index, u32 *color, SpanValues *span,
+                        u32 k_start, u32 k_end, bool test_edges) {
+  for (u32 k = k_start; k < k_end; k++) {
+    if (test_edges) {
+      f32 e0 = span->edges[0] + setup->step_x[0][k];
+      f32 e1 = span->edges[1] + setup->step_x[1][k];
+      f32 e2 = span->edges[2] + setup->step_x[2][k];
+      if (!(0.0f <= e0 && 0.0f <= e1 && 0.0f <= e2))
+        continue;
+    }
+    shade_fragment(setup, depthbuffer, depth_index + k, color + k, span, k);
+  }
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+
+#define RASTER_SIMD
+
+__attribute__((target("sse2"))) static inline __m128i
+depth_to_unorm_sse2(DepthBuffer *depthbuffer, __m128 depth) {
+  __m128 d = _mm_mul_ps(depth, _mm_set1_ps(depthbuffer->unorm_scale));
+  d = _mm_min_ps(_mm_max_ps(d, _mm_setzero_ps()), _mm_set1_ps(1.0f));
+  d = _mm_mul_ps(d, _mm_set1_ps(depth_format_unorm_max[depthbuffer->format]));
+  return _mm_cvttps_epi32(_mm_add_ps(d, _mm_set1_ps(0.5f)));
+}
+
+// Depth tests 4 pixels starting at `index` and writes the passed ones.
+// Returns `mask` of the passed pixels.
+__attribute__((target("sse2"))) static inline __m128
+depth_test_sse2(DepthBuffer *depthbuffer, u32 index, __m128 depth,
+                __m128 mask) {
+  switch (depthbuffer->format) {
+  case DepthF32: {
+    f32 *p = (f32 *)depthbuffer->data + index;
+    __m128 current = _mm_loadu_ps(p);
+    mask = _mm_and_ps(mask, _mm_cmplt_ps(current, depth));
+    _mm_storeu_ps(p, _mm_or_ps(_mm_and_ps(mask, depth),
+                               _mm_andnot_ps(mask, current)));
+    break;
+  }
+  case DepthUnorm16: {
+    u16 *p = (u16 *)depthbuffer->data + index;
+    __m128i d = depth_to_unorm_sse2(depthbuffer, depth);
+    __m128i current = _mm_unpacklo_epi16(_mm_loadl_epi64((__m128i *)p),
+                                         _mm_setzero_si128());
+    mask = _mm_and_ps(mask, _mm_castsi128_ps(_mm_cmplt_epi32(current, d)));
+    __m128i imask = _mm_castps_si128(mask);
+    __m128i v = _mm_or_si128(_mm_and_si128(imask, d),
+                             _mm_andnot_si128(imask, current));
+    // SSE2 has only the signed pack, so sign extend the low 16 bits to keep
+    // them intact.
+    v = _mm_srai_epi32(_mm_slli_epi32(v, 16), 16);
+    _mm_storel_epi64((__m128i *)p, _mm_packs_epi32(v, v));
+    break;
+  }
+  case DepthUnorm24: {
+    u32 *p = (u32 *)depthbuffer->data + index;
+    __m128i d = depth_to_unorm_sse2(depthbuffer, depth);
+    __m128i current = _mm_loadu_si128((__m128i *)p);
+    mask = _mm_and_ps(mask, _mm_castsi128_ps(_mm_cmplt_epi32(current, d)));
+    __m128i imask = _mm_castps_si128(mask);
+    _mm_storeu_si128((__m128i *)p,
+                     _mm_or_si128(_mm_and_si128(imask, d),
+                                  _mm_andnot_si128(imask, current)));
+    break;
+  }
+  }
+  return mask;
+}
+
+// The SSE2 kernel uses load/blend/store for the masked writes, so it can
+// touch pixels of the span outside [k_start, k_end) and the whole span must
+// be inside of the row.
+__attribute__((target("sse2"))) void
+raster_span_sse2(TriangleSetup *setup, DepthBuffer *depthbuffer,
+                 u32 depth_index, u32 *color, SpanValues *span, u32 k_start,
+                 u32 k_end, bool test_edges) {
+  __m128 zero = _mm_setzero_ps();
+  __m128 scale = _mm_set1_ps(255.0f);
+  __m128 abs_mask = _mm_castsi128_ps(_mm_set1_epi32(0x7FFFFFFF));
+  __m128i first = _mm_set1_epi32((i32)k_start - 1);
+  __m128i last = _mm_set1_epi32((i32)k_end);
+  f32 *a = span->attributes;
+  f32(*step)[RASTER_BLOCK_SIZE] = setup->attribute_step_x;
+
+  for (u32 h = 0; h < RASTER_BLOCK_SIZE; h += 4) {
+    if (k_end <= h || h + 4 <= k_start)
+      continue;
+
+    __m128i lane = _mm_setr_epi32(h, h + 1, h + 2, h + 3);
+    __m128 mask = _mm_castsi128_ps(_mm_and_si128(
+        _mm_cmpgt_epi32(lane, first), _mm_cmplt_epi32(lane, last)));
+
+    if (test_edges) {
+      for (u32 i = 0; i < 3; i++) {
+        __m128 e = _mm_add_ps(_mm_set1_ps(span->edges[i]),
+                              _mm_loadu_ps(&setup->step_x[i][h]));
+        mask = _mm_and_ps(mask, _mm_cmple_ps(zero, e));
+      }
+      if (!_mm_movemask_ps(mask))
+        continue;
+    }
+
+    __m128 d = _mm_add_ps(_mm_set1_ps(a[AttributeDepth]),
+                          _mm_loadu_ps(&step[AttributeDepth][h]));
+    mask = depth_test_sse2(depthbuffer, depth_index + h, d, mask);
+    if (!_mm_movemask_ps(mask))
+      continue;
+
+    __m128i imask = _mm_castps_si128(mask);
+    if (depthbuffer->ids) {
+      __m128i *ids = (__m128i *)(depthbuffer->ids + depth_index + h);
+      _mm_storeu_si128(ids, _mm_or_si128(
+                                _mm_and_si128(imask, _mm_set1_epi32(setup->id)),
+                                _mm_andnot_si128(imask, _mm_loadu_si128(ids))));
+      continue;
+    }
+
+    __m128i c = _mm_setzero_si128();
+    for (u32 i = AttributeNormalX; i <= AttributeNormalZ; i++) {
+      __m128 n = _mm_add_ps(_mm_set1_ps(a[i]), _mm_loadu_ps(&step[i][h]));
+      n = _mm_and_ps(_mm_mul_ps(n, scale), abs_mask);
+      c = _mm_or_si128(_mm_slli_epi32(c, 8), _mm_cvttps_epi32(n));
+    }
+    __m128i current_color = _mm_loadu_si128((__m128i *)(color + h));
+    _mm_storeu_si128((__m128i *)(color + h),
+                     _mm_or_si128(_mm_and_si128(imask, c),
+                                  _mm_andnot_si128(imask, current_color)));
+  }
+}
+
+__attribute__((target("avx2"))) static inline __m256i
+depth_to_unorm_avx2(DepthBuffer *depthbuffer, __m256 depth) {
+  __m256 d = _mm256_mul_ps(depth, _mm256_set1_ps(depthbuffer->unorm_scale));
+  d = _mm256_min_ps(_mm256_max_ps(d, _mm256_setzero_ps()),
+                    _mm256_set1_ps(1.0f));
+  d = _mm256_mul_ps(
+      d, _mm256_set1_ps(depth_format_unorm_max[depthbuffer->format]));
+  return _mm256_cvttps_epi32(_mm256_add_ps(d, _mm256_set1_ps(0.5f)));
+}
+
+// Depth tests 8 pixels starting at `index` and writes the passed ones.
+// Returns `mask` of the passed pixels.
+__attribute__((target("avx2"))) static inline __m256
+depth_test_avx2(DepthBuffer *depthbuffer, u32 index, __m256 depth,
+                __m256 mask) {
+  switch (depthbuffer->format) {
+  case DepthF32: {
+    f32 *p = (f32 *)depthbuffer->data + index;
+    __m256 current = _mm256_loadu_ps(p);
+    mask = _mm256_and_ps(mask, _mm256_cmp_ps(current, depth, _CMP_LT_OQ));
+    _mm256_maskstore_ps(p, _mm256_castps_si256(mask), depth);
+    break;
+  }
+  case DepthUnorm16: {
+    // There is no 16 bit masked store, so blend and store the whole span.
+    u16 *p = (u16 *)depthbuffer->data + index;
+    __m256i d = depth_to_unorm_avx2(depthbuffer, depth);
+    __m256i current = _mm256_cvtepu16_epi32(_mm_loadu_si128((__m128i *)p));
+    mask = _mm256_and_ps(
+        mask, _mm256_castsi256_ps(_mm256_cmpgt_epi32(d, current)));
+    __m256i v = _mm256_blendv_epi8(current, d, _mm256_castps_si256(mask));
+    _mm_storeu_si128((__m128i *)p,
+                     _mm_packus_epi32(_mm256_castsi256_si128(v),
+                                      _mm256_extracti128_si256(v, 1)));
+    break;
+  }
+  case DepthUnorm24: {
+    u32 *p = (u32 *)depthbuffer->data + index;
+    __m256i d = depth_to_unorm_avx2(depthbuffer, depth);
+    __m256i current = _mm256_loadu_si256((__m256i *)p);
+    mask = _mm256_and_ps(
+        mask, _mm256_castsi256_ps(_mm256_cmpgt_epi32(d, current)));
+    _mm256_maskstore_epi32((i32 *)p, _mm256_castps_si256(mask), d);
+    break;
+  }
+  }
+  return mask;
+}
+
+__attribute__((target("avx2"))) void
+raster_span_avx2(TriangleSetup *setup, DepthBuffer *depthbuffer,
+                 u32 depth_index, u32 *color, SpanValues *span, u32 k_start,
+                 u32 k_end, bool test_edges) {
+  __m256 zero = _mm256_setzero_ps();
+  __m256 scale = _mm256_set1_ps(255.0f);
+  __m256 abs_mask = _mm256_castsi256_ps(_mm256_set1_epi32(0x7FFFFFFF));
+  f32 *a = span->attributes;
+  f32(*step)[RASTER_BLOCK_SIZE] = setup->attribute_step_x;
+
+  __m256i lane = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+  __m256 mask = _mm256_castsi256_ps(_mm256_and_si256(
+      _mm256_cmpgt_epi32(lane, _mm256_set1_epi32((i32)k_start - 1)),
+      _mm256_cmpgt_epi32(_mm256_set1_epi32((i32)k_end), lane)));
+
+  if (test_edges) {
+    for (u32 i = 0; i < 3; i++) {
+      __m256 e = _mm256_add_ps(_mm256_set1_ps(span->edges[i]),
+                               _mm256_loadu_ps(&setup->step_x[i][0]));
+      mask = _mm256_and_ps(mask, _mm256_cmp_ps(zero, e, _CMP_LE_OQ));
+    }
+    if (!_mm256_movemask_ps(mask))
+      return;
+  }
+
+  __m256 d = _mm256_add_ps(_mm256_set1_ps(a[AttributeDepth]),
+                           _mm256_loadu_ps(&step[AttributeDepth][0]));
+  mask = depth_test_avx2(depthbuffer, depth_index, d, mask);
+  if (!_mm256_movemask_ps(mask))
+    return;
+
+  if (depthbuffer->ids) {
+    _mm256_maskstore_epi32((i32 *)(depthbuffer->ids + depth_index),
+                           _mm256_castps_si256(mask),
+                           _mm256_set1_epi32(setup->id));
+    return;
+  }
+
+  __m256i c = _mm256_setzero_si256();
+  for (u32 i = AttributeNormalX; i <= AttributeNormalZ; i++) {
+    __m256 n =
+        _mm256_add_ps(_mm256_set1_ps(a[i]), _mm256_loadu_ps(&step[i][0]));
+    n = _mm256_and_ps(_mm256_mul_ps(n, scale), abs_mask);
+    c = _mm256_or_si256(_mm256_slli_epi32(c, 8), _mm256_cvttps_epi32(n));
+  }
+  _mm256_maskstore_epi32((i32 *)color, _mm256_castps_si256(mask), c);
+}
+#endif
+
+typedef enum {
+  RasterScalar,
+  RasterSSE2,
+  RasterAVX2,
+} RasterKernel;
+
+const char *raster_kernel_names[] = {"Scalar", "SSE2", "AVX2"};
+
+// Span kernel used by the rasterizers. Selected at startup with
+// `raster_use_kernel` and must not be changed while rendering.
+RasterSpanFn raster_span = raster_span_scalar;
+
+bool raster_kernel_supported(RasterKernel kernel) {
+  switch (kernel) {
+  case RasterScalar:
+    return true;
+#ifdef RASTER_SIMD
+  case RasterSSE2:
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("sse2") != 0;
+  case RasterAVX2:
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2") != 0;
+#endif
+  default:
+    return false;
+  }
+}
+
+RasterKernel raster_best_kernel() {
+  if (raster_kernel_supported(RasterAVX2))
+    return RasterAVX2;
+  if (raster_kernel_supported(RasterSSE2))
+    return RasterSSE2;
+  return RasterScalar;
+}
+
+void raster_use_kernel(RasterKernel kernel) {
+  ASSERT(raster_kernel_supported(kernel), "Raster kernel %s is not supported",
+         raster_kernel_names[kernel]);
+  switch (kernel) {
+  case RasterScalar:
+    raster_span = raster_span_scalar;
+    break;
+#ifdef RASTER_SIMD
+  case RasterSSE2:
+    raster_span = raster_span_sse2;
+    break;
+  case RasterAVX2:
+    raster_span = raster_span_avx2;
+    break;
+#endif
+  default:
+    break;
+  }
+}
+
+// Vector kernels load whole spans, so the spans at the right edge of the
+// bitmap which do not fit into the row fall back to the scalar kernel.
+static inline RasterSpanFn raster_span_at(BitMap *dst, u32 span_x) {
+  return span_x + RASTER_BLOCK_SIZE <= dst->width ? raster_span
+                                                  : raster_span_scalar;
+}
+
+
+typedef enum {
+  BlockOutside,
+  BlockPartial,
+  BlockInside,
+} BlockCoverage;
+
+// Classifies the RASTER_BLOCK_SIZE x RASTER_BLOCK_SIZE block at (bx, by) by
+// the edge values at the centers of its corner pixels. Edge functions are
+// linear, so a block with all corners outside of one edge is fully outside
+// of the triangle and a block with all corners inside of every edge is fully
+// inside of it.
+BlockCoverage raster_block_coverage(TriangleSetup *setup, u32 bx, u32 by) {
+  bool inside = true;
+  for (u32 i = 0; i < 3; i++) {
+    EdgeFunction *e = &setup->edges[i];
+    f32 last = setup->step_x[i][RASTER_BLOCK_SIZE - 1];
+    f32 top = edge_span(e, edge_row(e, by), bx);
+    f32 bottom = edge_span(e, edge_row(e, by + RASTER_BLOCK_SIZE - 1), bx);
+    f32 c0 = top;
+    f32 c1 = top + last;
+    f32 c2 = bottom;
+    f32 c3 = bottom + last;
+    if (c0 < 0.0f && c1 < 0.0f && c2 < 0.0f && c3 < 0.0f)
+      return BlockOutside;
+    if (!(0.0f <= c0 && 0.0f <= c1 && 0.0f <= c2 && 0.0f <= c3))
+      inside = false;
+  }
+  return inside ? BlockInside : BlockPartial;
+}
+
+// Shades the part of the block at (bx, by) inside of
+// [x_start, x_end) x [y_start, y_end).
+void raster_block(TriangleSetup *setup, DepthBuffer *depthbuffer, BitMap *dst,
+                  u32 bx, u32 by, u32 x_start, u32 x_end, u32 y_start,
+                  u32 y_end, bool test_edges) {
+  RasterSpanFn span_fn = raster_span_at(dst, bx);
+  u32 k_start = bx < x_start ? x_start - bx : 0;
+  u32 k_end = MIN(x_end - bx, RASTER_BLOCK_SIZE);
+  u32 row_end = MIN(by + RASTER_BLOCK_SIZE, y_end);
+  for (u32 y = MAX(by, y_start); y < row_end; y++) {
+    u32 *color_row = (u32 *)(dst->data + y * dst->width * dst->channels);
+    u32 depth_row = y * depthbuffer->width;
+    SpanValues row;
+    SpanValues span;
+    span_values_row(setup, y, &row);
+    span_values_span(setup, &row, bx, &span);
+    span_fn(setup, depthbuffer, depth_row + bx, color_row + bx, &span, k_start,
+            k_end, test_edges);
+  }
+}
+
+// [min, max] of the depth the rasterizers compute for the pixel centers of
+// the block at (bx, by). A pixel depth is made by rounded adds and multiplies
+// of the row, the span and the step values, and rounding is monotonic, so
+// the depth is monotonic along the rows and the columns of the block and its
+// extremes are at the corner pixels. The corners are evaluated the same way
+// as the pixels, with the depth operations of `span_values_row` and
+// `span_values_span`, so the range is exact and HiZ never changes the result.
+void hiz_block_range(TriangleSetup *setup, u32 bx, u32 by, f32 *min, f32 *max) {
+  AttributePlane *plane = &setup->attributes[AttributeDepth];
+  f32 *step = setup->attribute_step_x[AttributeDepth];
+  f32 dx = pixel_offset(bx, setup->origin.x);
+  f32 top_dy = pixel_offset(by, setup->origin.y);
+  f32 bottom_dy = pixel_offset(by + RASTER_BLOCK_SIZE - 1, setup->origin.y);
+  f32 top_row = plane->dy * top_dy + plane->value;
+  f32 bottom_row = plane->dy * bottom_dy + plane->value;
+  f32 top = plane->dx * dx + top_row;
+  f32 bottom = plane->dx * dx + bottom_row;
+  f32 c0 = top + step[0];
+  f32 c1 = top + step[RASTER_BLOCK_SIZE - 1];
+  f32 c2 = bottom + step[0];
+  f32 c3 = bottom + step[RASTER_BLOCK_SIZE - 1];
+  *min = MIN(MIN(c0, c1), MIN(c2, c3));
+  *max = MAX(MAX(c0, c1), MAX(c2, c3));
+}
+
+#ifdef HIZ_CHECK
+// Depth test of `depth_test` without the write.
+static inline bool depth_test_passes(DepthBuffer *depthbuffer, u32 index,
+                                     f32 depth) {
+  switch (depthbuffer->format) {
+  case DepthF32:
+    return ((f32 *)depthbuffer->data)[index] < depth;
+  case DepthUnorm16:
+    return ((u16 *)depthbuffer->data)[index] <
+           depth_to_unorm(depthbuffer, depth);
+  case DepthUnorm24:
+    return ((u32 *)depthbuffer->data)[index] <
+           depth_to_unorm(depthbuffer, depth);
+  }
+  return false;
+}
+
+// Built with HIZ_CHECK, every block skipped by HiZ is checked to have no
+// pixel which would pass the depth test, so the image is the same as
+// without HiZ.
+void hiz_check_hidden(DepthBuffer *depthbuffer, TriangleSetup *setup, u32 bx,
+                      u32 by) {
+  u32 row_end = MIN(by + RASTER_BLOCK_SIZE, depthbuffer->hight);
+  u32 k_end = MIN(RASTER_BLOCK_SIZE, depthbuffer->width - bx);
+  for (u32 y = by; y < row_end; y++) {
+    SpanValues row;
+    SpanValues span;
+    span_values_row(setup, y, &row);
+    span_values_span(setup, &row, bx, &span);
+    for (u32 k = 0; k < k_end; k++) {
+      f32 d = span.attributes[AttributeDepth] +
+              setup->attribute_step_x[AttributeDepth][k];
+      ASSERT(!depth_test_passes(depthbuffer, y * depthbuffer->width + bx + k,
+                                d),
+             "HiZ skipped a visible pixel at %d %d", bx + k, y);
+    }
+  }
+}
+#endif
+
+// Returns true if no pixel of the triangle in the block at (bx, by) can pass
+// the depth test.
+static inline bool hiz_block_hidden(DepthBuffer *depthbuffer,
+                                    TriangleSetup *setup, u32 bx, u32 by) {
+  if (!depthbuffer->hiz)
+    return false;
+  f32 min, max;
+  hiz_block_range(setup, bx, by, &min, &max);
+  u32 cell = bx / RASTER_BLOCK_SIZE +
+             by / RASTER_BLOCK_SIZE * depthbuffer->hiz_width;
+  bool hidden = max <= depthbuffer->hiz[cell];
+#ifdef HIZ_CHECK
+  if (hidden)
+    hiz_check_hidden(depthbuffer, setup, bx, by);
+#endif
+  return hidden;
+}
+
+// Called after the triangle has covered the whole block at (bx, by). Every
+// pixel of the block is now at least as near as the triangle there.
+static inline void hiz_block_update(DepthBuffer *depthbuffer,
+                                    TriangleSetup *setup, u32 bx, u32 by) {
+  if (!depthbuffer->hiz)
+    return;
+  f32 min, max;
+  hiz_block_range(setup, bx, by, &min, &max);
+  u32 cell = bx / RASTER_BLOCK_SIZE +
+             by / RASTER_BLOCK_SIZE * depthbuffer->hiz_width;
+  depthbuffer->hiz[cell] = MAX(depthbuffer->hiz[cell], min);
+}
+
+// Returns true if the block at (bx, by) is fully inside of
+// [x_start, x_end) x [y_start, y_end).
+static inline bool raster_block_clipped(u32 bx, u32 by, u32 x_start, u32 x_end,
+                                        u32 y_start, u32 y_end) {
+  return bx < x_start || x_end < bx + RASTER_BLOCK_SIZE || by < y_start ||
+         y_end < by + RASTER_BLOCK_SIZE;
+}
+
+// Shades pixels [x_start, x_end) of the row `y` with the span kernel. Spans
+// in blocks behind the HiZ bound are skipped.
+void raster_row(TriangleSetup *setup, DepthBuffer *depthbuffer, BitMap *dst,
+                u32 y, u32 x_start, u32 x_end, bool test_edges) {
+  u32 *color_row = (u32 *)(dst->data + y * dst->width * dst->channels);
+  u32 depth_row = y * depthbuffer->width;
+  u32 by = y & ~(RASTER_BLOCK_SIZE - 1);
+
+  SpanValues row;
+  span_values_row(setup, y, &row);
+
+  u32 span_x = x_start & ~(RASTER_BLOCK_SIZE - 1);
+  for (; span_x < x_end; span_x += RASTER_BLOCK_SIZE) {
+    if (hiz_block_hidden(depthbuffer, setup, span_x, by))
+      continue;
+    SpanValues span;
+    span_values_span(setup, &row, span_x, &span);
+
+    u32 k_start = span_x < x_start ? x_start - span_x : 0;
+    u32 k_end = MIN(x_end - span_x, RASTER_BLOCK_SIZE);
+    raster_span_at(dst, span_x)(setup, depthbuffer, depth_row + span_x,
+                                color_row + span_x, &span, k_start, k_end,
+                                test_edges);
+  }
+}
+
+// Rows drawn by the scanline rasterizer in the current RASTER_BLOCK_SIZE
+// rows band. Rows are drawn top to bottom, so a block of the band inside of
+// [x_start, x_end) of all of its rows is fully covered by the triangle.
+typedef struct {
+  u32 by;
+  u32 rows_num;
+  u32 x_start;
+  u32 x_end;
+} ScanlineBand;
+
+// Updates the HiZ cells of the blocks the triangle covered in the band.
+void scanline_band_flush(DepthBuffer *depthbuffer, TriangleSetup *setup,
+                         ScanlineBand *band) {
+  if (!depthbuffer->hiz || band->rows_num != RASTER_BLOCK_SIZE)
+    return;
+  u32 bx = (band->x_start + RASTER_BLOCK_SIZE - 1) & ~(RASTER_BLOCK_SIZE - 1);
+  for (; bx + RASTER_BLOCK_SIZE <= band->x_end; bx += RASTER_BLOCK_SIZE)
+    hiz_block_update(depthbuffer, setup, bx, band->by);
+}
+
+// Adds the row `y` drawn in [x_start, x_end) to the band, starting a new one
+// when the row is in the next band.
+void scanline_band_add(DepthBuffer *depthbuffer, TriangleSetup *setup,
+                       ScanlineBand *band, u32 y, u32 x_start, u32 x_end) {
+  u32 by = y & ~(RASTER_BLOCK_SIZE - 1);
+  if (band->by != by || band->rows_num == 0) {
+    scanline_band_flush(depthbuffer, setup, band);
+    band->by = by;
+    band->rows_num = 0;
+    band->x_start = x_start;
+    band->x_end = x_end;
+  }
+  band->rows_num++;
+  band->x_start = MAX(band->x_start, x_start);
+  band->x_end = MIN(band->x_end, x_end);
+}
+
+void draw_triangle_span(DepthBuffer *depthbuffer, BitMap *dst, AABB *aabb_dst,
+                        u32 y, f32 left, f32 right, TriangleSetup *setup,
+                        ScanlineBand *band) {
+  f32 line_start = MAX(ceilf(left - 0.5), aabb_dst->min.x);
+  f32 line_end = MIN(ceilf(right - 0.5), aabb_dst->max.x);
+  if (line_end <= line_start)
+    return;
+
+  u32 x_start = f32_to_u32_round_down(line_start);
+  u32 x_end = f32_to_u32_round_down(line_end);
+  raster_row(setup, depthbuffer, dst, y, x_start, x_end, false);
+  scanline_band_add(depthbuffer, setup, band, y, x_start, x_end);
+}
+
+// Draws rows with centers in [v0.y, v1.y) where v1.y == v2.y.
+void draw_triangle_flat_bottom(DepthBuffer *depthbuffer, BitMap *dst,
+                               AABB *aabb_dst, Triangle *triangle,
+                               TriangleSetup *setup, ScanlineBand *band) {
+  f32 row_start = MAX(ceilf(triangle->v0.y - 0.5), aabb_dst->min.y);
+  f32 row_end = MIN(ceilf(triangle->v1.y - 0.5), aabb_dst->max.y);
+  if (row_end <= row_start)
+    return;
+
+  f32 inv_slope_1 =
+      (triangle->v1.x - triangle->v0.x) / (triangle->v1.y - triangle->v0.y);
+  f32 inv_slope_2 =
+      (triangle->v2.x - triangle->v0.x) / (triangle->v2.y - triangle->v0.y);
+
+  u32 y_start = f32_to_u32_round_down(row_start);
+  u32 y_end = f32_to_u32_round_down(row_end);
+  for (u32 y = y_start; y < y_end; y++) {
+    f32 dy = (f32)y + 0.5 - triangle->v0.y;
+    f32 x1 = triangle->v0.x + inv_slope_1 * dy;
+    f32 x2 = triangle->v0.x + inv_slope_2 * dy;
+    draw_triangle_span(depthbuffer, dst, aabb_dst, y, MIN(x1, x2), MAX(x1, x2),
+                       setup, band);
+  }
+}
+
+// Draws rows with centers in [v0.y, v2.y) where v0.y == v1.y.
+void draw_triangle_flat_top(DepthBuffer *depthbuffer, BitMap *dst,
+                            AABB *aabb_dst, Triangle *triangle,
+                            TriangleSetup *setup, ScanlineBand *band) {
+  f32 row_start = MAX(ceilf(triangle->v0.y - 0.5), aabb_dst->min.y);
+  f32 row_end = MIN(ceilf(triangle->v2.y - 0.5), aabb_dst->max.y);
+  if (row_end <= row_start)
+    return;
+
+  f32 inv_slope_1 =
+      (triangle->v2.x - triangle->v0.x) / (triangle->v2.y - triangle->v0.y);
+  f32 inv_slope_2 =
+      (triangle->v2.x - triangle->v1.x) / (triangle->v2.y - triangle->v1.y);
+
+  u32 y_start = f32_to_u32_round_down(row_start);
+  u32 y_end = f32_to_u32_round_down(row_end);
+  for (u32 y = y_start; y < y_end; y++) {
+    f32 x1 = triangle->v0.x + inv_slope_1 * ((f32)y + 0.5 - triangle->v0.y);
+    f32 x2 = triangle->v1.x + inv_slope_2 * ((f32)y + 0.5 - triangle->v1.y);
+    draw_triangle_span(depthbuffer, dst, aabb_dst, y, MIN(x1, x2), MAX(x1, x2),
+                       setup, band);
+  }
+}
+
+// Draw a triangle assuming vertices are in the CCW order.
+void draw_triangle_standard(DepthBuffer *depthbuffer, BitMap *dst,
+                            Rect *rect_dst, u32 id, Triangle triangle,
+                            CullMode cullmode) {
+  if (triangle_culled(&triangle, cullmode))
+    return;
+
+  AABB aabb_tri = triangle_aabb(&triangle);
+  AABB aabb_dst = raster_clip_aabb(dst, rect_dst);
+
+  if (!aabb_intersect(&aabb_tri, &aabb_dst))
+    return;
+
+  TriangleSetup setup;
+  if (!triangle_setup(&setup, &triangle))
+    return;
+  setup.id = id;
+
+  AABB intersection = aabb_intersection(&aabb_tri, &aabb_dst);
+
+  V3 s_v0;
+  V3 s_v1;
+  V3 s_v2;
+
+  if (triangle.v0.y < triangle.v1.y) {
+    if (triangle.v1.y < triangle.v2.y) {
+      s_v0 = triangle.v0;
+      s_v1 = triangle.v1;
+      s_v2 = triangle.v2;
+    } else {
+      if (triangle.v0.y < triangle.v2.y) {
+        s_v0 = triangle.v0;
+        s_v1 = triangle.v2;
+        s_v2 = triangle.v1;
+      } else {
+        s_v0 = triangle.v2;
+        s_v1 = triangle.v0;
+        s_v2 = triangle.v1;
+      }
+    }
+  } else {
+    if (triangle.v0.y < triangle.v2.y) {
+      s_v0 = triangle.v1;
+      s_v1 = triangle.v0;
+      s_v2 = triangle.v2;
+    } else {
+      if (triangle.v1.y < triangle.v2.y) {
+        s_v0 = triangle.v1;
+        s_v1 = triangle.v2;
+        s_v2 = triangle.v0;
+      } else {
+        s_v0 = triangle.v2;
+        s_v1 = triangle.v1;
+        s_v2 = triangle.v0;
+      }
+    }
+  }
+  ASSERT((s_v0.y <= s_v1.y && s_v1.y <= s_v2.y),
+         "Vertices are not sorted: s_v2.y: %f, s_v1.y: %f, s_v0.y: %f", s_v2.y,
+         s_v1.y, s_v0.y);
+
+  // Spans behind the HiZ bound are skipped and the bound is raised for the
+  // blocks the triangle covers once their band is drawn.
+  ScanlineBand band = {0};
+  Triangle sorted_triangle = {
+      .v0 = s_v0,
+      .v1 = s_v1,
+      .v2 = s_v2,
+  };
+  if (s_v1.y == s_v2.y) {
+    draw_triangle_flat_bottom(depthbuffer, dst, &intersection,
+                              &sorted_triangle, &setup, &band);
+    scanline_band_flush(depthbuffer, &setup, &band);
+    return;
+  }
+  if (s_v0.y == s_v1.y) {
+    draw_triangle_flat_top(depthbuffer, dst, &intersection, &sorted_triangle,
+                           &setup, &band);
+    scanline_band_flush(depthbuffer, &setup, &band);
+    return;
+  }
+
+  V3 v4 = {
+      .x = s_v0.x + ((s_v1.y - s_v0.y) / (s_v2.y - s_v0.y)) * (s_v2.x - s_v0.x),
+      .y = s_v1.y,
+      .z = 0.0,
+  };
+
+  Triangle flat_bottom = {
+      .v0 = s_v0,
+      .v1 = s_v1,
+      .v2 = v4,
+  };
+  draw_triangle_flat_bottom(depthbuffer, dst, &intersection, &flat_bottom,
+                            &setup, &band);
+  Triangle flat_top = {
+      .v0 = s_v1,
+      .v1 = v4,
+      .v2 = s_v2,
+  };
+  draw_triangle_flat_top(depthbuffer, dst, &intersection, &flat_top, &setup,
+                         &band);
+  scanline_band_flush(depthbuffer, &setup, &band);
+}
+
+void draw_triangle_barycentric(DepthBuffer *depthbuffer, BitMap *dst,
+                               Rect *rect_dst, u32 id, Triangle triangle,
+                               CullMode cullmode) {
+  if (triangle_culled(&triangle, cullmode))
+    return;
+
+  AABB aabb_tri = triangle_aabb(&triangle);
+  AABB aabb_dst = raster_clip_aabb(dst, rect_dst);
+
+  if (!aabb_intersect(&aabb_tri, &aabb_dst))
+    return;
+
+  TriangleSetup setup;
+  if (!triangle_setup(&setup, &triangle))
+    return;
+  setup.id = id;
+
+  AABB intersection = aabb_intersection(&aabb_tri, &aabb_dst);
+
+  u32 x_start = f32_to_u32_round_down(intersection.min.x);
+  u32 y_start = f32_to_u32_round_down(intersection.min.y);
+  u32 x_end = f32_to_u32_round_down(ceilf(intersection.max.x));
+  u32 y_end = f32_to_u32_round_down(ceilf(intersection.max.y));
+
+  // Blocks fully outside of the triangle or behind the HiZ bound are skipped
+  // and blocks fully inside of it are filled without per pixel edge tests.
+  u32 bx_start = x_start & ~(RASTER_BLOCK_SIZE - 1);
+  u32 by_start = y_start & ~(RASTER_BLOCK_SIZE - 1);
+  for (u32 by = by_start; by < y_end; by += RASTER_BLOCK_SIZE) {
+    for (u32 bx = bx_start; bx < x_end; bx += RASTER_BLOCK_SIZE) {
+      BlockCoverage coverage = raster_block_coverage(&setup, bx, by);
+      if (coverage == BlockOutside ||
+          hiz_block_hidden(depthbuffer, &setup, bx, by))
+        continue;
+      raster_block(&setup, depthbuffer, dst, bx, by, x_start, x_end, y_start,
+                   y_end, coverage == BlockPartial);
+      if (coverage == BlockInside &&
+          !raster_block_clipped(bx, by, x_start, x_end, y_start, y_end))
+        hiz_block_update(depthbuffer, &setup, bx, by);
+    }
+  }
+}
+
+// Vertices are snapped to a grid with SUBPIXEL_BITS of sub pixel precision
+// and edge functions are evaluated exactly with integers, so the coverage
+// does not depend on the evaluation order. Pixels with centers exactly on an
+// edge belong only to the triangle for which it is a top or a left edge,
+// so every pixel on an edge shared by two triangles is drawn exactly once.
+#define SUBPIXEL_BITS 8
+#define SUBPIXEL_ONE (1 << SUBPIXEL_BITS)
+// Coordinates are limited so that edge function values fit into i64.
+#define FIXED_MAX_COORD (1 << 22)
+
+typedef struct {
+  i64 a;
+  i64 b;
+  i64 origin_x;
+  i64 origin_y;
+  // 0 for the top and left edges and 1 for the rest. The pixel is inside of
+  // the edge if the edge value is not less than `min`.
+  i64 min;
+} FixedEdgeFunction;
+
+typedef struct {
+  FixedEdgeFunction edges[3];
+  // Only attributes are used from it.
+  TriangleSetup attributes;
+} FixedTriangleSetup;
+
+static inline i64 fixed_coord(f32 v) {
+  return (i64)floorf(v * (f32)SUBPIXEL_ONE + 0.5f);
+}
+
+static inline i64 fixed_pixel_center(u32 p) {
+  return ((i64)p << SUBPIXEL_BITS) + SUBPIXEL_ONE / 2;
+}
+
+FixedEdgeFunction fixed_edge_function(i64 from_x, i64 from_y, i64 to_x,
+                                      i64 to_y) {
+  FixedEdgeFunction e = {
+      .a = from_y - to_y,
+      .b = to_x - from_x,
+      .origin_x = from_x,
+      .origin_y = from_y,
+  };
+  return e;
+}
+
+static inline i64 fixed_edge(FixedEdgeFunction *e, u32 x, u32 y) {
+  return e->a * (fixed_pixel_center(x) - e->origin_x) +
+         e->b * (fixed_pixel_center(y) - e->origin_y);
+}
+
+// Returns false for the degenerate triangles and the triangles outside of
+// the FIXED_MAX_COORD range.
+bool fixed_triangle_setup(FixedTriangleSetup *setup, Triangle *triangle) {
+  V3 *v[3] = {&triangle->v0, &triangle->v1, &triangle->v2};
+  i64 x[3];
+  i64 y[3];
+  for (u32 i = 0; i < 3; i++) {
+    if (!(fabsf(v[i]->x) < FIXED_MAX_COORD && fabsf(v[i]->y) < FIXED_MAX_COORD))
+      return false;
+    x[i] = fixed_coord(v[i]->x);
+    y[i] = fixed_coord(v[i]->y);
+  }
+
+  setup->edges[0] = fixed_edge_function(x[1], y[1], x[2], y[2]);
+  setup->edges[1] = fixed_edge_function(x[2], y[2], x[0], y[0]);
+  setup->edges[2] = fixed_edge_function(x[0], y[0], x[1], y[1]);
+
+  i64 area = (x[1] - x[0]) * (y[2] - y[0]) - (y[1] - y[0]) * (x[2] - x[0]);
+  if (area == 0)
+    return false;
+
+  if (area < 0) {
+    for (u32 i = 0; i < 3; i++) {
+      setup->edges[i].a = -setup->edges[i].a;
+      setup->edges[i].b = -setup->edges[i].b;
+    }
+    area = -area;
+  }
+
+  // Edge values grow towards the inside of the triangle, so for a left edge
+  // they grow along x and for a top edge along y.
+  for (u32 i = 0; i < 3; i++) {
+    FixedEdgeFunction *e = &setup->edges[i];
+    bool top_left = 0 < e->a || (e->a == 0 && 0 < e->b);
+    e->min = top_left ? 0 : 1;
+  }
+
+  return triangle_setup(&setup->attributes, triangle);
+}
+
+BlockCoverage fixed_block_coverage(FixedTriangleSetup *setup, u32 bx, u32 by) {
+  bool inside = true;
+  for (u32 i = 0; i < 3; i++) {
+    FixedEdgeFunction *e = &setup->edges[i];
+    u32 last = RASTER_BLOCK_SIZE - 1;
+    i64 c0 = fixed_edge(e, bx, by);
+    i64 c1 = fixed_edge(e, bx + last, by);
+    i64 c2 = fixed_edge(e, bx, by + last);
+    i64 c3 = fixed_edge(e, bx + last, by + last);
+    if (c0 < e->min && c1 < e->min && c2 < e->min && c3 < e->min)
+      return BlockOutside;
+    if (!(e->min <= c0 && e->min <= c1 && e->min <= c2 && e->min <= c3))
+      inside = false;
+  }
+  return inside ? BlockInside : BlockPartial;
+}
+
+void fixed_block(FixedTriangleSetup *setup, DepthBuffer *depthbuffer,
+                 BitMap *dst, u32 bx, u32 by, u32 x_start, u32 x_end,
+                 u32 y_start, u32 y_end, bool test_edges) {
+  FixedEdgeFunction *edges = setup->edges;
+  i64 step0 = edges[0].a << SUBPIXEL_BITS;
+  i64 step1 = edges[1].a << SUBPIXEL_BITS;
+  i64 step2 = edges[2].a << SUBPIXEL_BITS;
+
+  u32 x_first = MAX(bx, x_start);
+  u32 x_last = MIN(bx + RASTER_BLOCK_SIZE, x_end);
+  u32 row_end = MIN(by + RASTER_BLOCK_SIZE, y_end);
+  for (u32 y = MAX(by, y_start); y < row_end; y++) {
+    u32 *color_row = (u32 *)(dst->data + y * dst->width * dst->channels);
+    u32 depth_row = y * depthbuffer->width;
+    SpanValues row;
+    SpanValues span;
+    span_values_row(&setup->attributes, y, &row);
+    span_values_span(&setup->attributes, &row, bx, &span);
+    i64 e0 = fixed_edge(&edges[0], x_first, y);
+    i64 e1 = fixed_edge(&edges[1], x_first, y);
+    i64 e2 = fixed_edge(&edges[2], x_first, y);
+    for (u32 x = x_first; x < x_last; x++) {
+      if (!test_edges ||
+          (edges[0].min <= e0 && edges[1].min <= e1 && edges[2].min <= e2))
+        shade_fragment(&setup->attributes, depthbuffer, depth_row + x,
+                       color_row + x, &span, x - bx);
+      e0 += step0;
+      e1 += step1;
+      e2 += step2;
+    }
+  }
+}
+
+void draw_triangle_fixed(DepthBuffer *depthbuffer, BitMap *dst, Rect *rect_dst,
+                         u32 id, Triangle triangle, CullMode cullmode) {
+  if (triangle_culled(&triangle, cullmode))
+    return;
+
+  AABB aabb_tri = triangle_aabb(&triangle);
+  AABB aabb_dst = raster_clip_aabb(dst, rect_dst);
+
+  if (!aabb_intersect(&aabb_tri, &aabb_dst))
+    return;
+
+  FixedTriangleSetup setup;
+  if (!fixed_triangle_setup(&setup, &triangle))
+    return;
+  setup.attributes.id = id;
+
+  AABB intersection = aabb_intersection(&aabb_tri, &aabb_dst);
+
+  u32 x_start = f32_to_u32_round_down(intersection.min.x);
+  u32 y_start = f32_to_u32_round_down(intersection.min.y);
+  u32 x_end = f32_to_u32_round_down(ceilf(intersection.max.x));
+  u32 y_end = f32_to_u32_round_down(ceilf(intersection.max.y));
+
+  u32 bx_start = x_start & ~(RASTER_BLOCK_SIZE - 1);
+  u32 by_start = y_start & ~(RASTER_BLOCK_SIZE - 1);
+  for (u32 by = by_start; by < y_end; by += RASTER_BLOCK_SIZE) {
+    for (u32 bx = bx_start; bx < x_end; bx += RASTER_BLOCK_SIZE) {
+      BlockCoverage coverage = fixed_block_coverage(&setup, bx, by);
+      if (coverage == BlockOutside ||
+          hiz_block_hidden(depthbuffer, &setup.attributes, bx, by))
+        continue;
+      fixed_block(&setup, depthbuffer, dst, bx, by, x_start, x_end, y_start,
+                  y_end, coverage == BlockPartial);
+      if (coverage == BlockInside &&
+          !raster_block_clipped(bx, by, x_start, x_end, y_start, y_end))
+        hiz_block_update(depthbuffer, &setup.attributes, bx, by);
+    }
+  }
+}
+
+// `id` is the index of the triangle, it is written to the visibility buffer.
+void draw_triangle(DepthBuffer *depthbuffer, BitMap *dst, Rect *rect_dst,
+                   u32 id, Triangle triangle, CullMode cullmode,
+                   TriangleMode mode) {
+  switch (mode) {
+  case Standard:
+    draw_triangle_standard(depthbuffer, dst, rect_dst, id, triangle,
+                           cullmode);
+    break;
+  case Barycentric:
+    draw_triangle_barycentric(depthbuffer, dst, rect_dst, id, triangle,
+                              cullmode);
+    break;
+  case Fixed:
+    draw_triangle_fixed(depthbuffer, dst, rect_dst, id, triangle, cullmode);
+    break;
+  }
+}
+
+// Sort-middle rendering: triangles are binned into screen tiles and every
+// tile is rasterized by a single thread, which owns the tile's part of the
+// color and depth buffers. Triangles keep their submission order inside a
+// tile, so the output is the same as drawing them one by one on one thread.
+#define TILE_SIZE 64
+
+typedef struct {
+  u32 tiles_x;
+  u32 tiles_y;
+  // Triangles of the tile `i` are in
+  // `triangles[offsets[i]..offsets[i + 1]]`
+  u32 *offsets;
+  u32 *triangles;
+} TileBins;
+
+// Returns false if the triangle does not touch any tile.
+bool triangle_tile_range(Triangle *triangle, BitMap *dst, u32 *tx_min,
+                         u32 *ty_min, u32 *tx_max, u32 *ty_max) {
+  AABB aabb_tri = triangle_aabb(triangle);
+  AABB aabb_dst = {{0.0, 0.0}, {dst->width, dst->hight}};
+  if (!aabb_intersect(&aabb_tri, &aabb_dst))
+    return false;
+
+  AABB intersection = aabb_intersection(&aabb_tri, &aabb_dst);
+  u32 x_end = f32_to_u32_round_down(ceilf(intersection.max.x));
+  u32 y_end = f32_to_u32_round_down(ceilf(intersection.max.y));
+  if (x_end == 0 || y_end == 0)
+    return false;
+
+  *tx_min = f32_to_u32_round_down(intersection.min.x) / TILE_SIZE;
+  *ty_min = f32_to_u32_round_down(intersection.min.y) / TILE_SIZE;
+  *tx_max = (x_end - 1) / TILE_SIZE;
+  *ty_max = (y_end - 1) / TILE_SIZE;
+  return true;
+}
+
+// Triangles are binned in batches of TILE_BIN_BATCH, one job per batch.
+#define TILE_BIN_BATCH 4096
+
+typedef struct {
+  Memory *memory;
+  BitMap *dst;
+  Triangle *triangles;
+  u32 triangles_num;
+  CullMode cullmode;
+  TileBins *bins;
+  // Triangles of every tile in the batch, in the frame memory of the thread
+  // which counted them. Turned into the positions the batch fills from.
+  u32 **batch_counts;
+} TileBinData;
+
+// Counts the triangles of the batch per tile, or stores them into the bins
+// once the counts are turned into positions.
+void bin_batch(TileBinData *bd, u32 batch, bool fill) {
+  TileBins *bins = bd->bins;
+  u32 *counts = bd->batch_counts[batch];
+  u32 end = MIN((batch + 1) * TILE_BIN_BATCH, bd->triangles_num);
+  u32 tx_min, ty_min, tx_max, ty_max;
+  for (u32 i = batch * TILE_BIN_BATCH; i < end; i++) {
+    if (triangle_culled(&bd->triangles[i], bd->cullmode) ||
+        !triangle_tile_range(&bd->triangles[i], bd->dst, &tx_min, &ty_min,
+                             &tx_max, &ty_max))
+      continue;
+    for (u32 ty = ty_min; ty <= ty_max; ty++) {
+      for (u32 tx = tx_min; tx <= tx_max; tx++) {
+        if (fill)
+          bins->triangles[counts[tx + ty * bins->tiles_x]++] = i;
+        else
+          counts[tx + ty * bins->tiles_x]++;
+      }
+    }
+  }
+}
+
+void bin_count_batch(void *data, u32 batch) {
+  TileBinData *bd = data;
+  u32 tiles_num = bd->bins->tiles_x * bd->bins->tiles_y;
+  u32 *counts =
+      thread_frame_alloc_array(bd->memory, thread_index(), u32, tiles_num);
+  ASSERT(counts, "Thread frame memory is full");
+  memset(counts, 0, tiles_num * sizeof(u32));
+  bd->batch_counts[batch] = counts;
+  bin_batch(bd, batch, false);
+}
+
+void bin_fill_batch(void *data, u32 batch) { bin_batch(data, batch, true); }
+
+// Needs the thread memory of the pool, see `init_thread_memory`.
+TileBins bin_triangles(Memory *memory, ThreadPool *pool, BitMap *dst,
+                       Triangle *triangles, u32 triangles_num,
+                       CullMode cullmode) {
+  TileBins bins = {
+      .tiles_x = (dst->width + TILE_SIZE - 1) / TILE_SIZE,
+      .tiles_y = (dst->hight + TILE_SIZE - 1) / TILE_SIZE,
+  };
+  u32 tiles_num = bins.tiles_x * bins.tiles_y;
+  u32 batches_num = (triangles_num + TILE_BIN_BATCH - 1) / TILE_BIN_BATCH;
+  TileBinData bd = {
+      .memory = memory,
+      .dst = dst,
+      .triangles = triangles,
+      .triangles_num = triangles_num,
+      .cullmode = cullmode,
+      .bins = &bins,
+      .batch_counts = frame_alloc_array(memory, u32 *, batches_num),
+  };
+
+  // First pass counts triangles per tile and batch, second one fills the
+  // bins. Batches of a tile follow each other, so triangles keep their
+  // order.
+  thread_pool_run(pool, bin_count_batch, &bd, batches_num);
+
+  bins.offsets = frame_alloc_array(memory, u32, tiles_num + 1);
+  u32 offset = 0;
+  for (u32 i = 0; i < tiles_num; i++) {
+    bins.offsets[i] = offset;
+    for (u32 b = 0; b < batches_num; b++) {
+      u32 count = bd.batch_counts[b][i];
+      bd.batch_counts[b][i] = offset;
+      offset += count;
+    }
+  }
+  bins.offsets[tiles_num] = offset;
+
+  bins.triangles = frame_alloc_array(memory, u32, offset);
+  thread_pool_run(pool, bin_fill_batch, &bd, batches_num);
+  return bins;
+}
+
+typedef struct {
+  TileBins *bins;
+  Triangle *triangles;
+  DepthBuffer *depthbuffer;
+  BitMap *dst;
+  CullMode cullmode;
+  TriangleMode mode;
+} TileRenderData;
+
+void render_tile(void *data, u32 tile) {
+  TileRenderData *rd = data;
+  u32 tx = tile % rd->bins->tiles_x;
+  u32 ty = tile / rd->bins->tiles_x;
+  f32 x_min = (f32)(tx * TILE_SIZE);
+  f32 y_min = (f32)(ty * TILE_SIZE);
+  f32 width = (f32)(MIN((tx + 1) * TILE_SIZE, rd->dst->width)) - x_min;
+  f32 hight = (f32)(MIN((ty + 1) * TILE_SIZE, rd->dst->hight)) - y_min;
+  Rect tile_rect = {
+      .pos = {x_min + width / 2.0, y_min + hight / 2.0},
+      .width = width,
+      .hight = hight,
+  };
+
+  for (u32 i = rd->bins->offsets[tile]; i < rd->bins->offsets[tile + 1]; i++) {
+    u32 t = rd->bins->triangles[i];
+    draw_triangle(rd->depthbuffer, rd->dst, &tile_rect, t, rd->triangles[t],
+                  rd->cullmode, rd->mode);
+  }
+}
+
+void draw_triangles_tiled(Memory *memory, ThreadPool *pool,
+                          DepthBuffer *depthbuffer, BitMap *dst,
+                          Triangle *triangles, u32 triangles_num,
+                          CullMode cullmode, TriangleMode mode) {
+  TileBins bins =
+      bin_triangles(memory, pool, dst, triangles, triangles_num, cullmode);
+  TileRenderData rd = {
+      .bins = &bins,
+      .triangles = triangles,
+      .depthbuffer = depthbuffer,
+      .dst = dst,
+      .cullmode = cullmode,
+      .mode = mode,
+  };
+  thread_pool_run(pool, render_tile, &rd, bins.tiles_x * bins.tiles_y);
+}
+
+typedef struct {
+  DepthBuffer *depthbuffer;
+  BitMap *dst;
+  Triangle *triangles;
+} ResolveData;
+
+// Shades the covered pixels of the rows [band * TILE_SIZE,
+// (band + 1) * TILE_SIZE) from the visibility buffer. Attributes are
+// evaluated the same way as in the span kernels, so the result is the same
+// as shading during rasterization.
+void resolve_band(void *data, u32 band) {
+  ResolveData *rd = data;
+  DepthBuffer *depthbuffer = rd->depthbuffer;
+  BitMap *dst = rd->dst;
+  u32 y_end = MIN((band + 1) * TILE_SIZE, dst->hight);
+
+  // Neighbour pixels mostly belong to the same triangle, so the setup of the
+  // last one is kept.
+  TriangleSetup setup;
+  u32 setup_id = VISIBILITY_EMPTY;
+  for (u32 y = band * TILE_SIZE; y < y_end; y++) {
+    u32 *color_row = (u32 *)(dst->data + y * dst->width * dst->channels);
+    u32 *ids_row = depthbuffer->ids + y * depthbuffer->width;
+    for (u32 span_x = 0; span_x < dst->width; span_x += RASTER_BLOCK_SIZE) {
+      SpanValues row;
+      SpanValues span;
+      u32 span_id = VISIBILITY_EMPTY;
+      u32 k_end = MIN(dst->width - span_x, RASTER_BLOCK_SIZE);
+      for (u32 k = 0; k < k_end; k++) {
+        u32 id = ids_row[span_x + k];
+        if (id == VISIBILITY_EMPTY)
+          continue;
+        if (id != setup_id) {
+          // Only triangles with a valid setup are rasterized.
+          triangle_setup(&setup, &rd->triangles[id]);
+          setup_id = id;
+        }
+        if (id != span_id) {
+          span_values_row(&setup, y, &row);
+          span_values_span(&setup, &row, span_x, &span);
+          span_id = id;
+        }
+        color_row[span_x + k] = shade_pixel(&setup, &span, k);
+      }
+    }
+  }
+}
+
+// Shades every pixel of the visibility buffer once. `triangles` are the ones
+// the ids were rasterized from.
+void resolve_visibility(ThreadPool *pool, DepthBuffer *depthbuffer,
+                        BitMap *dst, Triangle *triangles) {
+  ResolveData rd = {
+      .depthbuffer = depthbuffer,
+      .dst = dst,
+      .triangles = triangles,
+  };
+  u32 bands_num = (dst->hight + TILE_SIZE - 1) / TILE_SIZE;
+  thread_pool_run(pool, resolve_band, &rd, bands_num);
+}
+
+#endif
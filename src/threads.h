@@ -0,0 +1,306 @@
+#ifndef SOFTY_THREADS
+#define SOFTY_THREADS
+
+#include "defines.h"
+#include "log.h"
+#include "math.h"
+
+#ifndef __EMSCRIPTEN__
+#include <pthread.h>
+#include <sched.h>
+#include <stdalign.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+#define MAX_THREADS 64
+// Jobs waiting in the queue of one thread. Ranges are split in halves, so a
+// parallel for only keeps log2 of its tasks in a queue.
+#define JOB_QUEUE_SIZE 1024
+// Rounds of looking for jobs before an idle worker goes to sleep.
+#define JOB_SPIN_ROUNDS 64
+
+// Called once for every index in [0, tasks_num).
+typedef void (*TaskFn)(void *data, u32 index);
+
+// Number of jobs of a group that have not finished yet.
+typedef struct {
+#ifndef __EMSCRIPTEN__
+  atomic_uint pending;
+#else
+  u32 pending;
+#endif
+} JobCounter;
+
+// Runs `fn` for the indices in [begin, end).
+typedef struct {
+  TaskFn fn;
+  void *data;
+  u32 begin;
+  u32 end;
+  JobCounter *counter;
+} Job;
+
+#ifndef __EMSCRIPTEN__
+// Work stealing deque. The owner thread pushes and takes jobs at the
+// bottom, other threads steal them from the top.
+typedef struct {
+  alignas(64) _Atomic i64 top;
+  alignas(64) _Atomic i64 bottom;
+  Job jobs[JOB_QUEUE_SIZE];
+} JobQueue;
+
+typedef struct ThreadPool ThreadPool;
+
+typedef struct {
+  ThreadPool *pool;
+  u32 index;
+} ThreadPoolWorker;
+#endif
+
+// Fixed pool of worker threads with a job queue per thread. Queue 0 belongs
+// to the thread that made the pool, which runs jobs as well while it waits
+// for them, so a pool with 0 workers runs everything inline. Jobs are
+// submitted from that thread or from other jobs. Emscripten builds have no
+// threads and run jobs when they are submitted.
+typedef struct ThreadPool {
+  u32 threads_num;
+#ifndef __EMSCRIPTEN__
+  pthread_t threads[MAX_THREADS];
+  ThreadPoolWorker workers[MAX_THREADS];
+  JobQueue *queues;
+  pthread_mutex_t mutex;
+  pthread_cond_t work_cond;
+  atomic_uint queued;
+  atomic_uint sleepers;
+  bool stop;
+#endif
+} ThreadPool;
+
+u32 cpu_count() {
+#ifndef __EMSCRIPTEN__
+  i64 n = sysconf(_SC_NPROCESSORS_ONLN);
+  if (0 < n)
+    return (u32)n;
+#endif
+  return 1;
+}
+
+#ifndef __EMSCRIPTEN__
+// Queue of the current thread, 0 for the thread that made the pool.
+_Thread_local u32 __thread_pool_index = 0;
+
+void __job_push(ThreadPool *pool, Job job) {
+  JobQueue *queue = &pool->queues[__thread_pool_index];
+  i64 bottom = atomic_load_explicit(&queue->bottom, memory_order_relaxed);
+  i64 top = atomic_load_explicit(&queue->top, memory_order_acquire);
+  ASSERT((bottom - top < JOB_QUEUE_SIZE), "Job queue %d is full",
+         __thread_pool_index);
+  queue->jobs[bottom & (JOB_QUEUE_SIZE - 1)] = job;
+  atomic_store_explicit(&queue->bottom, bottom + 1, memory_order_release);
+
+  atomic_fetch_add(&pool->queued, 1);
+  if (atomic_load(&pool->sleepers)) {
+    pthread_mutex_lock(&pool->mutex);
+    pthread_cond_signal(&pool->work_cond);
+    pthread_mutex_unlock(&pool->mutex);
+  }
+}
+
+bool __job_take(JobQueue *queue, Job *job) {
+  i64 bottom = atomic_load_explicit(&queue->bottom, memory_order_relaxed) - 1;
+  atomic_store_explicit(&queue->bottom, bottom, memory_order_relaxed);
+  atomic_thread_fence(memory_order_seq_cst);
+  i64 top = atomic_load_explicit(&queue->top, memory_order_relaxed);
+
+  bool found = top <= bottom;
+  if (found) {
+    *job = queue->jobs[bottom & (JOB_QUEUE_SIZE - 1)];
+    if (top == bottom) {
+      // Last job, race the thieves for it.
+      found = atomic_compare_exchange_strong_explicit(
+          &queue->top, &top, top + 1, memory_order_seq_cst,
+          memory_order_relaxed);
+      atomic_store_explicit(&queue->bottom, bottom + 1, memory_order_relaxed);
+    }
+  } else {
+    atomic_store_explicit(&queue->bottom, bottom + 1, memory_order_relaxed);
+  }
+  return found;
+}
+
+bool __job_steal(JobQueue *queue, Job *job) {
+  i64 top = atomic_load_explicit(&queue->top, memory_order_acquire);
+  atomic_thread_fence(memory_order_seq_cst);
+  i64 bottom = atomic_load_explicit(&queue->bottom, memory_order_acquire);
+  if (bottom <= top)
+    return false;
+  *job = queue->jobs[top & (JOB_QUEUE_SIZE - 1)];
+  return atomic_compare_exchange_strong_explicit(&queue->top, &top, top + 1,
+                                                 memory_order_seq_cst,
+                                                 memory_order_relaxed);
+}
+
+// Takes a job from the queue of the current thread, or steals one from the
+// other threads.
+bool __job_find(ThreadPool *pool, Job *job) {
+  u32 queues_num = pool->threads_num + 1;
+  bool found = __job_take(&pool->queues[__thread_pool_index], job);
+  for (u32 i = 1; !found && i < queues_num; i++)
+    found = __job_steal(
+        &pool->queues[(__thread_pool_index + i) % queues_num], job);
+  if (found)
+    atomic_fetch_sub(&pool->queued, 1);
+  return found;
+}
+
+void __job_run(ThreadPool *pool, Job job) {
+  // Keep the first half of the range and leave the other one for thieves,
+  // until a single task is left.
+  while (1 < job.end - job.begin) {
+    Job half = job;
+    half.begin = job.begin + (job.end - job.begin) / 2;
+    job.end = half.begin;
+    atomic_fetch_add(&job.counter->pending, 1);
+    __job_push(pool, half);
+  }
+  job.fn(job.data, job.begin);
+  atomic_fetch_sub_explicit(&job.counter->pending, 1, memory_order_release);
+}
+
+void *__thread_pool_worker(void *arg) {
+  ThreadPoolWorker *worker = arg;
+  ThreadPool *pool = worker->pool;
+  __thread_pool_index = worker->index;
+
+  while (true) {
+    Job job;
+    bool found = false;
+    for (u32 i = 0; !found && i < JOB_SPIN_ROUNDS; i++) {
+      found = __job_find(pool, &job);
+      if (!found)
+        sched_yield();
+    }
+    if (found) {
+      __job_run(pool, job);
+      continue;
+    }
+
+    pthread_mutex_lock(&pool->mutex);
+    atomic_fetch_add(&pool->sleepers, 1);
+    while (!atomic_load(&pool->queued) && !pool->stop)
+      pthread_cond_wait(&pool->work_cond, &pool->mutex);
+    atomic_fetch_sub(&pool->sleepers, 1);
+    bool stop = pool->stop;
+    pthread_mutex_unlock(&pool->mutex);
+    if (stop)
+      break;
+  }
+  return NULL;
+}
+#endif
+
+// Index of the calling thread in the pool, 0 for the thread that made it and
+// 1 to threads_num for the workers. Indexes per thread data like the
+// thread frame memory.
+u32 thread_index() {
+#ifndef __EMSCRIPTEN__
+  return __thread_pool_index;
+#else
+  return 0;
+#endif
+}
+
+void thread_pool_init(ThreadPool *pool, u32 threads_num) {
+#ifdef __EMSCRIPTEN__
+  pool->threads_num = 0;
+#else
+  pool->threads_num = MIN(threads_num, MAX_THREADS);
+  pool->queues = mmap(NULL, sizeof(JobQueue) * (pool->threads_num + 1),
+                      PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1,
+                      0);
+  ASSERT((pool->queues != MAP_FAILED), "Failed to map job queues");
+  for (u32 i = 0; i < pool->threads_num + 1; i++) {
+    atomic_init(&pool->queues[i].top, 0);
+    atomic_init(&pool->queues[i].bottom, 0);
+  }
+  atomic_init(&pool->queued, 0);
+  atomic_init(&pool->sleepers, 0);
+  pool->stop = false;
+  pthread_mutex_init(&pool->mutex, NULL);
+  pthread_cond_init(&pool->work_cond, NULL);
+
+  for (u32 i = 0; i < pool->threads_num; i++) {
+    pool->workers[i] = (ThreadPoolWorker){.pool = pool, .index = i + 1};
+    i32 r = pthread_create(&pool->threads[i], NULL, __thread_pool_worker,
+                           &pool->workers[i]);
+    ASSERT((r == 0), "Failed to create worker thread %d", i);
+  }
+#endif
+  INFO("Started thread pool with %d workers", pool->threads_num);
+}
+
+void thread_pool_destroy(ThreadPool *pool) {
+#ifndef __EMSCRIPTEN__
+  pthread_mutex_lock(&pool->mutex);
+  pool->stop = true;
+  pthread_cond_broadcast(&pool->work_cond);
+  pthread_mutex_unlock(&pool->mutex);
+
+  for (u32 i = 0; i < pool->threads_num; i++)
+    pthread_join(pool->threads[i], NULL);
+
+  pthread_cond_destroy(&pool->work_cond);
+  pthread_mutex_destroy(&pool->mutex);
+  munmap(pool->queues, sizeof(JobQueue) * (pool->threads_num + 1));
+#endif
+  pool->threads_num = 0;
+}
+
+// Queue `fn` for every index in [0, tasks_num) without waiting. The range is
+// one job that is split as threads steal from it. `counter` tracks the jobs
+// and is waited on with `thread_pool_wait`, one counter can track many
+// submissions.
+void thread_pool_submit(ThreadPool *pool, TaskFn fn, void *data, u32 tasks_num,
+                        JobCounter *counter) {
+  if (!tasks_num)
+    return;
+#ifndef __EMSCRIPTEN__
+  if (pool->threads_num) {
+    atomic_fetch_add(&counter->pending, 1);
+    __job_push(pool, (Job){.fn = fn,
+                           .data = data,
+                           .begin = 0,
+                           .end = tasks_num,
+                           .counter = counter});
+    return;
+  }
+#endif
+  for (u32 i = 0; i < tasks_num; i++)
+    fn(data, i);
+}
+
+// Run jobs until all the jobs of `counter` are finished. Jobs can wait on
+// the jobs they submit.
+void thread_pool_wait(ThreadPool *pool, JobCounter *counter) {
+#ifndef __EMSCRIPTEN__
+  while (atomic_load_explicit(&counter->pending, memory_order_acquire)) {
+    Job job;
+    if (__job_find(pool, &job))
+      __job_run(pool, job);
+    else
+      sched_yield();
+  }
+#endif
+}
+
+// Run `fn` for every index in [0, tasks_num) and wait for all of them to
+// finish. Tasks may run and complete in any order.
+void thread_pool_run(ThreadPool *pool, TaskFn fn, void *data, u32 tasks_num) {
+  JobCounter counter = {0};
+  thread_pool_submit(pool, fn, data, tasks_num, &counter);
+  thread_pool_wait(pool, &counter);
+}
+
+#endif